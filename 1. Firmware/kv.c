@@ -0,0 +1,151 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#include "kv.h"
+
+// Every record is one flash page holding all values, so a record that was
+// only partly programmed fails its check and the one before it is used. The
+// records go round the sectors in order, a sector is erased when the log
+// comes back to it.
+#define KV_MAGIC 0x564B4D50   // "PMKV"
+#define KV_SECTORS 4
+#define SECTOR_PAGES ( FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE )
+#define KV_PAGES ( KV_SECTORS * SECTOR_PAGES )
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  // Value length per key, 0 if not set.
+  uint8_t len[ KV_KEYS ];
+  uint8_t value[ KV_KEYS ][ KV_VALUE_MAX ];
+  uint32_t check;
+} record_t;
+
+_Static_assert( sizeof( record_t ) <= FLASH_PAGE_SIZE, "KV record is larger than a flash page" );
+
+// Reserved in the linker script.
+extern uint8_t __kv_start[];
+
+// Newest record, the values every lookup reads.
+static record_t cache;
+static uint32_t cachePage;
+static bool loaded;
+static bool dirty;
+
+static uint32_t recordCheck( const record_t *r ) {
+  const uint32_t *w = (const uint32_t *) r;
+  uint32_t sum = 0x9E3779B9;
+
+  for ( uint32_t i = 0; i < offsetof( record_t, check ) / 4; ++i ) {
+    sum = ( sum ^ w[ i ] ) * 16777619u;
+  }
+
+  return sum;
+}
+
+static const record_t *recordAt( uint32_t page ) {
+  return (const record_t *) ( __kv_start + page * FLASH_PAGE_SIZE );
+}
+
+static bool recordValid( const record_t *r ) {
+  return r->magic == KV_MAGIC && r->check == recordCheck( r );
+}
+
+// Programming starts with the magic, so a page that was started on isn't blank.
+static bool pageBlank( uint32_t page ) {
+  return recordAt( page )->magic == 0xFFFFFFFF;
+}
+
+// Scan for the newest record, KV_PAGES if there is none.
+static void load( void ) {
+  uint32_t newest = KV_PAGES;
+
+  for ( uint32_t p = 0; p < KV_PAGES; ++p ) {
+    const record_t *r = recordAt( p );
+    if ( recordValid( r ) && ( newest == KV_PAGES || (int32_t) ( r->seq - recordAt( newest )->seq ) > 0 ) ) {
+      newest = p;
+    }
+  }
+
+  if ( newest == KV_PAGES ) {
+    memset( &cache, 0, sizeof( cache ) );
+  } else {
+    memcpy( &cache, recordAt( newest ), sizeof( cache ) );
+  }
+  cachePage = newest;
+  loaded = true;
+}
+
+bool kvGet( uint32_t key, void *value, uint32_t len ) {
+  if ( !loaded ) {
+    load();
+  }
+  if ( key >= KV_KEYS || cache.len[ key ] != len ) {
+    return false;
+  }
+
+  memcpy( value, cache.value[ key ], len );
+  return true;
+}
+
+void kvSet( uint32_t key, const void *value, uint32_t len ) {
+  if ( !loaded ) {
+    load();
+  }
+  if ( key >= KV_KEYS || len == 0 || len > KV_VALUE_MAX ) {
+    return;
+  }
+  if ( cache.len[ key ] == len && memcmp( cache.value[ key ], value, len ) == 0 ) {
+    return;
+  }
+
+  cache.len[ key ] = len;
+  memcpy( cache.value[ key ], value, len );
+  dirty = true;
+}
+
+bool kvDirty( void ) {
+  return dirty;
+}
+
+void kvFlush( void ) {
+  static uint8_t page[ FLASH_PAGE_SIZE ];
+
+  if ( !dirty ) {
+    return;
+  }
+
+  // Next page after the newest record. One that isn't blank is either the
+  // next sector to reuse or a write cut short, which moves on to the next
+  // sector as the newest record may share the page's sector.
+  uint32_t p = ( cachePage == KV_PAGES ) ? 0 : ( cachePage + 1 ) % KV_PAGES;
+  bool erase = false;
+  if ( !pageBlank( p ) ) {
+    if ( p % SECTOR_PAGES != 0 ) {
+      p = ( p / SECTOR_PAGES + 1 ) % KV_SECTORS * SECTOR_PAGES;
+    }
+    erase = true;
+  }
+
+  cache.magic = KV_MAGIC;
+  cache.seq = ( cachePage == KV_PAGES ) ? 0 : cache.seq + 1;
+  cache.check = recordCheck( &cache );
+
+  memset( page, 0xFF, sizeof( page ) );
+  memcpy( page, &cache, sizeof( cache ) );
+
+  uint32_t offset = (uint32_t) __kv_start - XIP_BASE;
+  uint32_t irq = save_and_disable_interrupts();
+  if ( erase ) {
+    flash_range_erase( offset + p / SECTOR_PAGES * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE );
+  }
+  flash_range_program( offset + p * FLASH_PAGE_SIZE, page, FLASH_PAGE_SIZE );
+  restore_interrupts( irq );
+
+  cachePage = p;
+  dirty = false;
+}
@@ -0,0 +1,29 @@
+#ifndef KV_H
+#define KV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Keys, each with room for KV_VALUE_MAX bytes.
+#define KV_SETTINGS    0
+#define KV_LAST_SLOT   1
+#define KV_QUICK_BOOTS 2
+#define KV_COUNTERS    3
+#define KV_KEYS        8
+#define KV_VALUE_MAX   28
+
+// Copy the value of key into value, false if it was never set or has another length.
+// The store is read from flash on first use, after that this is a copy from SRAM.
+bool kvGet( uint32_t key, void *value, uint32_t len );
+
+// Change the value in SRAM only. Written with the next kvFlush().
+void kvSet( uint32_t key, const void *value, uint32_t len );
+
+// Values changed since the last kvFlush().
+bool kvDirty( void );
+
+// Write all values as one record. Flash is not readable while this runs, and
+// the SSI is back on the boot2 setup afterwards.
+void kvFlush( void );
+
+#endif
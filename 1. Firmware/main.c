@@ -1,7 +1,106 @@
-//#define MULTICART
+// Serve the game compiled in from rom.h (binToCode.py) instead of the slots the
+// ROM patcher fills in. Without it the firmware decides at boot from the slot
+// directory: a patch with one game serves it straight away like this build,
+// more bring up the menu.
+//#define BUILTIN_ROM
+
+#ifndef BUILTIN_ROM
+#define MULTICART
+#endif
+
+// Copy ROMs that fit into SRAM and serve them from there instead of the flash.
+//#define SRAM_SERVING
+
+// Serve through a page table with an SRAM page cache that core1 refills from flash.
+//#define PAGE_CACHE
+
+// Serve the multicart through the page table too, without the cache. A slot
+// switch is then one word pushed to the HALE SM instead of a LALE program reload.
+//#define TABLE_SWITCH
+
+// Latch both address halves in one SM (addr_latch.pio) instead of HALE SM + DMA + LALE SM.
+//#define SINGLE_SM_ADDR
+
+// Time single byte DMA reads of flash and SRAM (and the page table) at boot, the
+// part of a bus read that depends on where the ROM is served from. The LALE
+// edge, the PIO latching and OE come on top; CLOCK_CALIBRATION times those.
+//#define MEASURE_DMA_LATENCY
+
+// Serve flash ROMs through the XIP cache, with the ROM header pinned in it.
+//#define XIP_CACHED
+
+// Retune the flash SSI (clock divider, sample delay) for the system clock at boot.
+//#define FLASH_TUNING
+
+// Step down the clock/voltage pair over several boots while the bus slack allows
+// it, then keep using the lowest good pair (stored in the key/value store). Each
+// serving class (SRAM, or the size of the flash window) is calibrated on the
+// boots that serve it from power-up. The result is written once nothing is
+// served from flash, or at the next pick when the menu is served from flash; a
+// game served from flash from power-up isn't calibrated. A power-up in which the
+// menu can hand over to any slot keeps to a pair all their classes passed.
+//#define CLOCK_CALIBRATION
+
+// Sleep core0 between checks while serving, and lower the clock when the bus is quiet.
+//#define LOW_POWER
+
+// Record the address of every read (and the time, with BUS_TRACE_TIME) in SRAM rings.
+// Dumped over USB when stdio USB is enabled in CMakeLists.txt.
+//#define BUS_TRACE
+//#define BUS_TRACE_TIME
+
+// Count reads, glitches, FIFO stalls and slot switches. Shown by the menu and over USB.
+//#define BUS_COUNTERS
+
+// Put slot count, titles, sizes and game codes into the menu's window, so the
+// menu doesn't need its titles patched in.
+//#define SLOT_METADATA
+
+// Check a slot against the CRC32 the patcher stored for it before serving it,
+// from the menu or at boot (which holds off serving while it reads the slot,
+// at the full clock).
+// A corrupt slot isn't served, the menu shows it. Needs SLOT_METADATA.
+//#define SLOT_CHECK
+
+// Remember the slot picked in the menu (in the key/value store) and serve it
+// straight away on the next power-up. Powering the cart up three times in a row,
+// each time for less than a few seconds, brings the menu back. Only for games
+// served from SRAM, the power-ups are counted in flash while the game runs; a
+// game served from flash brings up the menu. Needs SLOT_METADATA and SRAM_SERVING.
+//#define LAST_SLOT
+
+// Keep the write check running while a game is served. Writing "MENU" to an
+// address ending in 0x3FF brings the menu back without a power cycle; the game
+// has to wait in RAM and reset afterwards, like the menu does after a pick.
+//#define MENU_RETURN
+
+// Watch for the console starting over (a second of bus silence, then the BIOS
+// reading the cartridge header) and serve RESET_POLICY's image for it.
+// Needs MENU_RETURN and TABLE_SWITCH.
+//#define RESET_DETECT
+
+// Map 8 KB of SRAM at the top of the cartridge space (0x1FE000-0x1FFFFF) that
+// the game can write to. It is kept per slot in flash, written when the bus is quiet
+// if the game is served from SRAM (SRAM_SERVING), otherwise at the next pick or
+// return to the menu. Flash can't be written under a game served from it, so
+// such a game loses what it saved since then when the power goes.
+//#define SAVE_WINDOW
+
+// Start serving at half the clock straight away and go to the full clock once
+// the core voltage has settled, instead of leaving the bus unanswered for that.
+//#define FAST_BOOT
+
+// Timestamp the boot phases (us since the timer started), read out with a
+// debugger or over USB.
+//#define BOOT_TIMING
 
 #include "pico/stdlib.h"
 
+// HALE SM, lookup DMA and LALE SM through a page table (hale_table.pio, lale_table.pio).
+#if defined( PAGE_CACHE ) || defined( TABLE_SWITCH )
+#define PAGE_TABLE
+#endif
+
 #ifndef MULTICART
 #include "rom.h"
 #else
@@ -9,6 +108,13 @@
 //#include "multimenu.h"
 // For 16 MB Flash IC
 #include "multimenu_20slots.h"
+
+// Menus converted with binToCode.py --menu define ROM_MENU_SIZE. Older ones
+// neither show the counters nor read the metadata (nor wait on its busy flag),
+// and reset into the game before a copy to SRAM or the page cache is ready.
+#if ( defined( BUS_COUNTERS ) || defined( SLOT_METADATA ) || defined( SRAM_SERVING ) || defined( PAGE_CACHE ) ) && !defined( ROM_MENU_SIZE )
+#error "multimenu_20slots.h is older than the menu's load delay, status and metadata support, rebuild the menu and convert it with binToCode.py --menu."
+#endif
 #endif
 
 #include "hardware/clocks.h"
@@ -17,59 +123,2896 @@
 
 #include "hardware/pio.h"
 #include "hardware/dma.h"
+#include "hardware/structs/bus_ctrl.h"
 
 #include "oe.pio.h"
 #include "pushData.pio.h"
+
+#ifdef SINGLE_SM_ADDR
+#ifdef PAGE_TABLE
+#error "PAGE_CACHE and TABLE_SWITCH need the HALE SM for the table lookup, don't combine them with SINGLE_SM_ADDR."
+#endif
+
+// The address SM replaces the LALE SM, with the same shifts.
+#include "addr_latch.pio.h"
+#ifdef MULTICART
+#define lale_latch_program addr_latch_512k_program
+#else
+#define lale_latch_program addr_latch_program
+#endif
+#define lale_latch_program_init( pio, sm, offset, addrPin, lalePin ) addr_latch_program_init( pio, sm, offset, addrPin, HALE, lalePin )
+#define lale_latch_menu_program addr_latch_menu_program
+#define lale_latch_menu_program_init lale_latch_program_init
+#define lale_latch_sram_program addr_latch_sram_program
+#define lale_latch_sram_program_init lale_latch_program_init
+#else
 #include "hale.pio.h"
+#endif
 
 #ifdef MULTICART
 #include "writecheck.pio.h"
 #include "writecheck_addr.pio.h"
+#ifndef SINGLE_SM_ADDR
 #include "lale_menu.pio.h"
 #include "lale_512k.pio.h"
+#endif
 
 #define DELAY 100000
 #define ROMSIZE 524288
+#define ROMSIZE_BITS 19
+
+// Slot directory, filled in by the ROM patcher (found by the "SLOTDIR" marker).
+// Offsets are into rom[], sizes are powers of two and each slot is aligned to
+// its size, so the LALE SM can serve it as a window. No entries means the
+// fixed ROMSIZE slots.
+#define SLOTDIR_MAX 64
+#define SLOT_MIN_BITS 14
+#define SLOT_MAX_BITS 21
+
+// With the page table a slot can instead be a list of 4 KB blocks anywhere in
+// rom[], so slots can share identical blocks.
+#define BLOCK_BITS 12
+#define BLOCK_SIZE ( 1u << BLOCK_BITS )
+
+// With SRAM_SERVING a slot can also be LZ4 compressed (block format, no frame)
+// and is unpacked into the SRAM copy when it is selected.
+typedef struct {
+  // Offset into rom[], or the first blockMap entry if blocks isn't 0.
+  uint32_t offset;
+  // Window size, the unpacked size if packed isn't 0.
+  uint32_t size;
+  uint32_t blocks;
+  // Compressed size.
+  uint32_t packed;
+} slot_entry_t;
+
+// Boot slot when the menu is served from power-up.
+#define SLOTDIR_MENU 0xFFFFFFFF
+
+typedef struct {
+  char magic[ 8 ];
+  uint32_t capacity;
+  // Largest slot the firmware can unpack, 0 if it can't.
+  uint32_t unpackMax;
+  uint32_t count;
+  // Slot served from power-up without the menu, set by the patcher when it
+  // was given one game.
+  uint32_t boot;
+  slot_entry_t slot[ SLOTDIR_MAX ];
+} slot_dir_t;
+
+#ifdef PAGE_TABLE
+// Block numbers in rom[], filled in by the ROM patcher (found by the "BLOCKMAP" marker).
+#define BLOCKMAP_MAX ( NUM_GAMES * ROMSIZE / BLOCK_SIZE )
+
+typedef struct {
+  char magic[ 8 ];
+  uint16_t block[ BLOCKMAP_MAX ];
+} block_map_t;
+
+const volatile block_map_t blockMap __attribute__ ((used)) = { { 'B','L','O','C','K','M','A','P' } };
+#endif
+
+// LALE program rebuilt for the picked slot's window.
+uint16_t laleSlotInstructions[ 32 ];
+pio_program_t laleSlotProgram;
+
+// Slot served from power-up, -1 for the menu.
+int bootSlot = -1;
+
+#elif !defined( SINGLE_SM_ADDR )
+#include "lale.pio.h"
+#endif
+
+#ifdef SRAM_SERVING
+#include <string.h>
+#ifndef SINGLE_SM_ADDR
+#include "lale_sram.pio.h"
+#endif
+
+// SRAM window for ROMs up to 128 KB. Must match the shift in lale_sram.pio.
+#define SRAM_ROM_BITS 17
+#define SRAM_ROM_SIZE ( 1u << SRAM_ROM_BITS )
+
+uint8_t romSRAM[ SRAM_ROM_SIZE ] __attribute__ ((section(".romSRAM"), aligned( SRAM_ROM_SIZE )));
+
+#ifdef MULTICART
+// Time the last slot took to get into SRAM (copied or unpacked).
+volatile uint32_t slotLoadUs;
+#endif
+#endif
+
+#ifdef MULTICART
+// Volatile, as the patcher changes it after the build.
+#ifdef SRAM_SERVING
+const volatile slot_dir_t slotDir __attribute__ ((used)) = { "SLOTDIR", NUM_GAMES * ROMSIZE, SRAM_ROM_SIZE, 0, SLOTDIR_MENU };
+#else
+const volatile slot_dir_t slotDir __attribute__ ((used)) = { "SLOTDIR", NUM_GAMES * ROMSIZE, 0, 0, SLOTDIR_MENU };
+#endif
+#endif
+
+#ifdef PAGE_TABLE
+#if defined( TABLE_SWITCH ) && !defined( MULTICART )
+#error "TABLE_SWITCH is for switching MULTICART slots, use PAGE_CACHE for a single ROM."
+#endif
+
+#include "hale_table.pio.h"
+#include "lale_table.pio.h"
+
+// 1 KB pages, one per HALE value (A10-A20). Must match hale_table.pio and lale_table.pio.
+#define PAGE_BITS 10
+#define PAGE_SIZE ( 1u << PAGE_BITS )
+#define PAGE_COUNT 2048
+
+// Page address >> PAGE_BITS for each HALE value. Read by the lookup DMA.
+// Two of them: a new mapping is built in the one not served and handed to the
+// HALE SM as a whole.
+uint32_t pageTables[ 2 ][ PAGE_COUNT ] __attribute__ ((section(".romSRAM"), aligned( PAGE_COUNT * 4 )));
+
+// Table being built or served.
+uint32_t *pageTable = pageTables[ 0 ];
+
+// Flash address of each page, in the same format.
+uint32_t pageHome[ PAGE_COUNT ];
+
+// HALE SM taking the table base.
+uint tableSm;
+
+int lookup_dma;
+#endif
+
+#ifdef PAGE_CACHE
+#ifdef SRAM_SERVING
+#error "PAGE_CACHE already serves ROMs up to the pool size from SRAM, don't combine it with SRAM_SERVING."
+#endif
+
+#include <string.h>
+#include "pico/multicore.h"
+
+// Pages in the SRAM pool.
+#define POOL_PAGES 128
+
+// Pool entry holding each page, or -1.
+int16_t pageSlot[ PAGE_COUNT ];
+
+uint8_t pagePool[ POOL_PAGES * PAGE_SIZE ] __attribute__ ((section(".romSRAM"), aligned( PAGE_SIZE )));
+
+// Page held by each pool entry (PAGE_COUNT if free), its clock bit and
+// whether it was loaded ahead of use.
+uint16_t poolOwner[ POOL_PAGES ];
+uint8_t poolUsed[ POOL_PAGES ];
+uint8_t poolAhead[ POOL_PAGES ];
+uint32_t poolHand;
+
+// Page changes seen by core1, split by where the new page was served from.
+volatile uint32_t cacheHits;
+volatile uint32_t cacheMisses;
+
+// Pages loaded ahead of a sequential fetch stream, and how many were used.
+volatile uint32_t prefetchIssued;
+volatile uint32_t prefetchHits;
+#endif
+
+#ifdef MEASURE_DMA_LATENCY
+#include "hardware/structs/systick.h"
+
+#define LATENCY_SAMPLES 1024
+
+// Results in system clock cycles, read out with a debugger.
+// They include the trigger write and the busy polling, which is the same for both paths.
+typedef struct {
+  uint32_t min;
+  uint32_t avg;
+  uint32_t max;
+} latency_t;
+
+volatile latency_t latencyFlash;
+volatile latency_t latencySRAM;
+
+#ifdef PAGE_TABLE
+// The extra hop of the page table mode: the lookup DMA reading the table in SRAM.
+// It runs on HALE, so it only adds to a read if LALE follows within this time.
+volatile latency_t latencyTable;
+#endif
+
+#ifdef MULTICART
+// The last slot switch, up to the first read served through the new table or
+// LALE program: from the write (or reset read) that asked for it, in us with
+// the check and the SRAM copy, and from taking the old one off the bus, in
+// cycles. A switch at power-up isn't timed.
+#define SWITCH_WAIT_US 1000
+volatile uint32_t switchAskedUs;
+volatile uint32_t switchTotalUs;
+volatile uint32_t switchGapCycles;
+#endif
+#endif
+
+#ifdef XIP_CACHED
+#ifdef PAGE_CACHE
+#error "PAGE_CACHE reads flash through its own SRAM pool, don't combine it with XIP_CACHED."
+#endif
+
+#include "hardware/structs/xip_ctrl.h"
+
+// Cartridge header and interrupt vectors, see .min_header in the menu's startup.asm.
+#define PIN_START 0x2100
+#define PIN_END   0x2200
+
+#ifdef MEASURE_DMA_LATENCY
+// Random reads over the whole ROM, and reads of the pinned header only.
+volatile latency_t latencyCached;
+volatile latency_t latencyPinned;
+#endif
+
+// ROM whose header is pinned, pinned again after the cache was flushed.
+const uint8_t *pinnedROM;
+#endif
+
+// System clock and core voltage pairs, fastest first. The first one is what
+// the firmware always ran at, calibration steps down from there.
+typedef struct {
+  uint32_t khz;
+  enum vreg_voltage vreg;
+} clock_pair_t;
+
+const clock_pair_t clockPairs[] = {
+  { 240000, VREG_VOLTAGE_1_30 },
+  { 220000, VREG_VOLTAGE_1_25 },
+  { 200000, VREG_VOLTAGE_1_20 },
+  { 180000, VREG_VOLTAGE_1_15 },
+  { 160000, VREG_VOLTAGE_1_10 },
+  { 133000, VREG_VOLTAGE_1_10 },
+  { 125000, VREG_VOLTAGE_1_10 },
+};
+#define CLOCK_PAIRS ( sizeof( clockPairs ) / sizeof( clockPairs[ 0 ] ) )
+
+#ifdef CLOCK_CALIBRATION
+#ifdef PAGE_CACHE
+#error "PAGE_CACHE keeps core1 reading flash while the settings are written, don't combine it with CLOCK_CALIBRATION."
+#endif
+
+#include <string.h>
+#include "hardware/pwm.h"
+#include "settings.h"
+
+// Read cycles to sample per calibration boot, and how long to try.
+#define CAL_SAMPLES 4096
+#define CAL_TIMEOUT_US 2000000
+
+// Slack that has to be left between data ready and OE.
+#define CAL_MARGIN_NS 30
+
+// OE is seen up to this late by the polling loop, taken off the slack.
+#define CAL_POLL_CYCLES 8
+
+// Free running PWM counter used as a cycle clock DMA can read.
+#define CAL_PWM_SLICE 0
+#define CAL_NO_STAMP 0xFFFFFFFF
+
+settings_t settings;
+bool calibrating;
+
+// Class calibrated this boot, see calClass().
+uint32_t calBootCls;
+
+// Cycle count when data_dma finished the last read, written by stamp_dma.
+volatile uint32_t calStamp;
+
+// Result of this boot's run, read out with a debugger.
+volatile int32_t calSlackMin;
+volatile uint32_t calServiceMax;
+volatile uint32_t calSampleCount;
+#endif
+
+#ifdef LOW_POWER
+#include "hardware/structs/clocks.h"
+#include "hardware/structs/scb.h"
+#include "hardware/structs/systick.h"
+#include "hardware/irq.h"
+
+// How often core0 looks at the bus, and how long it has to be quiet.
+#define POWER_POLL_US 10000
+#define POWER_IDLE_US 1000000
+
+// clk_sys divider while idle. The PIO SMs still have to latch the first address
+// at this speed, the wake channel restores the divider before it is read.
+#define POWER_IDLE_DIV 2
+
+// Timer alarm that wakes core0. 3 belongs to the SDK's alarm pool.
+#define POWER_ALARM 2
+
+// Full speed clk_sys divider, copied back by the wake channel.
+uint32_t powerFullDiv;
+
+// Stand-ins for the current draw, read out with a debugger.
+volatile uint32_t powerIdleEntries;
+volatile uint64_t powerIdleUs;
+volatile uint64_t powerAwakeCycles;
+#endif
+
+#ifdef FAST_BOOT
+#ifdef FLASH_TUNING
+#error "FAST_BOOT starts serving before the full clock, FLASH_TUNING needs it to tune the SSI."
+#endif
+
+#include "hardware/pll.h"
+
+// clk_sys divider until the voltage has settled. Half of the fastest pair is
+// within spec at the default voltage.
+#define FAST_BOOT_DIV 2
+
+// What the second sleep_ms() of the normal boot waits for the voltage.
+#define FAST_BOOT_SETTLE_US 2000
+
+// When the voltage was set, and clk_sys at divider 1.
+uint32_t fastBootVregUs;
+uint32_t fastBootHz;
+#endif
+
+#ifdef BOOT_TIMING
+#define BOOT_MAIN       0  // main() entered
+#define BOOT_CLOCK      1  // Voltage and clock set
+#define BOOT_SERVING    2  // DMA chain started
+#define BOOT_FIRST_READ 3  // First read served
+#define BOOT_FULL_CLOCK 4  // At the full clock
+#define BOOT_PHASES     5
+
+// Timer at each phase, read out with a debugger. The first read stays 0
+// until one is served.
+volatile uint32_t bootUs[ BOOT_PHASES ];
+
+#define bootMark( phase ) ( bootUs[ phase ] = timer_hw->timerawl )
+
+// data_dma and its read address when serving started.
+int bootDataDma;
+uint32_t bootReadAddr;
+
+// Called from the serving loops. Marks the first read, found by data_dma's
+// read address moving.
+void __not_in_flash_func( bootPoll )( void ) {
+  if ( bootUs[ BOOT_FIRST_READ ] == 0 && dma_hw->ch[ bootDataDma ].read_addr != bootReadAddr ) {
+    bootMark( BOOT_FIRST_READ );
+  }
+}
+#else
+#define bootMark( phase )
+#endif
+
+// Trace, counters and boot times are reported over USB when stdio USB is enabled in CMakeLists.txt.
+#if LIB_PICO_STDIO_USB && ( defined( BUS_TRACE ) || defined( BUS_COUNTERS ) || defined( BOOT_TIMING ) )
+#define USB_REPORTS
+#include <stdio.h>
+#endif
+
+#if defined( LOW_POWER ) && defined( USB_REPORTS )
+#error "LOW_POWER keeps core0 asleep, it can't answer USB."
+#endif
+
+// RAM_RESIDENT is set by the CMake option of the same name.
+#if defined( RAM_RESIDENT ) && defined( USB_REPORTS )
+#error "RAM_RESIDENT leaves the USB stack in flash, disable stdio USB in CMakeLists.txt."
+#endif
+
+#ifdef BUS_TRACE
+
+// Reads kept, a power of two. The DMA ring wraps at 32 KB at most.
+#define TRACE_BITS 12
+#define TRACE_ENTRIES ( 1u << TRACE_BITS )
+
+// Address data_dma read for each bus read, oldest entry at the trace channel's
+// write address. With BUS_TRACE_TIME also the timer in us, same index.
+uint32_t traceAddr[ TRACE_ENTRIES ] __attribute__ ((section(".romSRAM"), aligned( TRACE_ENTRIES * 4 )));
+#ifdef BUS_TRACE_TIME
+uint32_t traceTime[ TRACE_ENTRIES ] __attribute__ ((section(".romSRAM"), aligned( TRACE_ENTRIES * 4 )));
+#endif
+#endif
+
+#ifdef BUS_COUNTERS
+#include <string.h>
+#include "hardware/irq.h"
+
+// Where the menu finds the counters, the last 1 KB of its 32 KB window.
+#define STATUS_OFFSET 0x7C00
+#define STATUS_MAGIC 0x54415453   // "STAT"
+
+// Layout shared with the menu (see drawStatusScreenAndBlocking()).
+typedef struct {
+  uint32_t magic;
+  uint32_t reads;         // Bytes served by data_dma.
+  uint32_t glitchHale;    // HALE pulses dropped by the glitch filter.
+  uint32_t glitchLale;    // LALE pulses dropped by the glitch filter.
+  uint32_t stallHale;     // Polls that found the HALE SM blocked on a full RX FIFO.
+  uint32_t stallLale;     // Same for the LALE SM.
+  uint32_t lostData;      // Polls that found a byte dropped on a full pushData TX FIFO.
+  uint32_t slotSwitches;  // Slots loaded from the menu.
+  uint32_t loadUs;        // Time the last slot took to get into SRAM (SRAM_SERVING).
+} counters_t;
+
+volatile counters_t counters;
+
+// Copy the menu reads, or NULL if there is none.
+volatile counters_t *statusBlock;
+
+// SMs watched in FDEBUG, -1 if not used.
+int countSmHale = -1;
+int countSmLale = -1;
+int countSmPush = -1;
+
+// Sniffer SUM over a constant 1 per read counts the reads.
+const uint32_t countOne = 1;
+uint32_t countSink;
+
+#if defined( MULTICART ) && defined( PAGE_TABLE )
+// Mapped over the last page of the menu window by the table.
+uint8_t statusPage[ 1024 ] __attribute__ ((section(".romSRAM"), aligned( 1024 )));
+#endif
+#endif
+
+#ifdef SLOT_METADATA
+#ifndef MULTICART
+#error "SLOT_METADATA is for the menu of MULTICART."
+#endif
+
+#include <string.h>
+
+// Where the menu finds the metadata, the 3 KB before the status block. The
+// menu has to end before it.
+#define META_OFFSET 0x7000
+#define META_SIZE 0x0C00
+#define META_MAGIC 0x4154454D   // "META"
+#define META_SLOTS SLOTDIR_MAX
+#define META_TITLE 21
+
+// Game code in the ROM header.
+#define META_CODE 0x21AC
+
+// Layout shared with the menu (see rebuildMenuIndex()). Unused slots have an
+// empty title.
+typedef struct {
+  char title[ META_TITLE ];
+  char code[ 4 ];         // Game code from the ROM header, blank if packed.
+  uint8_t bad;            // Failed its SLOT_CHECK.
+  uint8_t pad[ 2 ];
+  uint32_t size;          // Window or unpacked size in bytes.
+} meta_slot_t;
+
+typedef struct {
+  uint32_t magic;
+  uint8_t count;
+  uint8_t busy;           // A pick is being checked or loaded, the menu waits.
+  uint8_t pad[ 2 ];
+  meta_slot_t slot[ META_SLOTS ];
+} meta_t;
+
+_Static_assert( sizeof( meta_t ) <= META_SIZE, "Slot metadata is larger than its part of the menu window" );
+
+// Titles, filled in by the ROM patcher (found by the "SLOTNAME" marker).
+typedef struct {
+  char magic[ 8 ];
+  char title[ META_SLOTS ][ META_TITLE ];
+} slot_names_t;
+
+const volatile slot_names_t slotNames __attribute__ ((used)) = { { 'S','L','O','T','N','A','M','E' } };
+
+#ifdef PAGE_TABLE
+// Mapped over the metadata pages of the menu window by the table.
+uint8_t metaPage[ META_SIZE ] __attribute__ ((section(".romSRAM"), aligned( 1024 )));
+#endif
+
+// Metadata the menu reads, slots that can't be served are flagged in it.
+meta_t *metaServed;
+#endif
+
+#ifdef SLOT_CHECK
+#ifndef MULTICART
+#error "SLOT_CHECK is for the slots of MULTICART."
+#endif
+#ifndef SLOT_METADATA
+#error "SLOT_CHECK needs SLOT_METADATA, the menu waits for the check through its busy flag."
+#endif
+
+#include "hardware/structs/xip_ctrl.h"
+
+#define SLOT_UNCHECKED 0
+#define SLOT_GOOD      1
+#define SLOT_BAD       2
+
+// CRC32 (zlib) of each slot as stored: the ROM or its compressed data rounded
+// up to words, or its blocks in order. Filled in by the ROM patcher (found by
+// the "SLOTCRC" marker), len 0 isn't checked.
+typedef struct {
+  uint32_t len;
+  uint32_t crc;
+} slot_crc_entry_t;
+
+typedef struct {
+  char magic[ 8 ];
+  slot_crc_entry_t slot[ SLOTDIR_MAX ];
+} slot_crc_t;
+
+const volatile slot_crc_t slotCRC __attribute__ ((used)) = { "SLOTCRC" };
+
+// Result per slot, each slot is checked once per boot. Read out with a debugger.
+volatile uint8_t slotState[ SLOTDIR_MAX ];
+
+// How long the last check took.
+volatile uint32_t slotCheckUs;
+#endif
+
+#if defined( MULTICART ) && !defined( PAGE_TABLE ) && ( defined( BUS_COUNTERS ) || defined( SLOT_METADATA ) )
+// The menu is served from SRAM so the status block and the metadata can be put
+// into its window.
+#define MENU_SRAM
+uint8_t menuSRAM[ 32768 ] __attribute__ ((section(".romSRAM"), aligned( 32768 )));
+#endif
+
+#ifdef LAST_SLOT
+#ifndef MULTICART
+#error "LAST_SLOT needs the menu of MULTICART."
+#endif
+#ifndef SLOT_METADATA
+#error "LAST_SLOT writes the pick while the menu waits on the busy flag of SLOT_METADATA."
+#endif
+#ifndef SRAM_SERVING
+#error "LAST_SLOT counts the power-ups while the game is served from SRAM, it needs SRAM_SERVING."
+#endif
+
+// Power-ups in a row that ended before LAST_SLOT_STABLE_US of serving (plus a
+// quiet bus to write it down) that bring up the menu instead of the last slot.
+// A game that crashes straight away keeps the bus busy, so this gets there too.
+#define LAST_SLOT_QUICK 3
+#define LAST_SLOT_STABLE_US 5000000
+
+// The count of quick power-ups is back to 0 in the store.
+bool lastSlotStable;
+#endif
+
+#if defined( LAST_SLOT ) || defined( CLOCK_CALIBRATION )
+// Values kept in the store at the end of flash (kv.c). Changes stay in SRAM
+// until storePoll() finds the bus quiet.
+#define KV_STORE
+
+#include "hardware/sync.h"
+#include "kv.h"
+
+// Changed values are written to flash once the bus has been quiet this long
+// and nothing is served from flash, so the console can't fetch from it meanwhile.
+#define STORE_IDLE_US 100000
+
+int storeDataDma;
+uint32_t storeLastAddr;
+uint32_t storeLastSeen;
+
+// Changes that can't wait for a quiet bus (a game keeps it busy), written as
+// soon as nothing is served from flash.
+bool storeUrgent;
+
+#ifdef BUS_COUNTERS
+// Totals over all power-ups under KV_COUNTERS, brought up to date at most
+// every COUNTERS_STORE_US so counting doesn't wear the flash.
+#define COUNTERS_STORE_US 600000000
+
+typedef struct {
+  uint32_t boots;
+  uint32_t reads;
+  uint32_t glitches;
+  uint32_t lostData;
+  uint32_t slotSwitches;
+} counters_total_t;
+
+// Totals up to this power-up.
+counters_total_t countersBefore;
+uint32_t countersStoredAt;
+#endif
+
+// Goes with the slot lookup further down, called by the serving loops.
+void storePoll( void );
+#endif
+
+#ifdef MENU_RETURN
+#ifndef MULTICART
+#error "MENU_RETURN needs the menu of MULTICART."
+#endif
+
+// Written to 0x3FF (low address bits) one after the other by a game to get the menu back.
+const uint8_t menuSequence[] = { 'M', 'E', 'N', 'U' };
+
+// SMs the write check IRQ works with.
+uint cmdSmLale;
+uint cmdOffsetLale;
+uint cmdSmWe;
+uint cmdSmWeAddr;
+
+// Menu sequence bytes seen so far, and whether the menu is served.
+uint32_t cmdMatched;
+volatile bool menuServed;
+
+// Switch the write check IRQ asks for: a slot picked in the menu, CMD_MENU or
+// CMD_NONE. Done by commandPoll() from the serving loop.
+#define CMD_NONE -1
+#define CMD_MENU -2
+volatile int32_t cmdPending = CMD_NONE;
+
+// Goes with menuStart() further down, called by the serving loops.
+void commandPoll( void );
+
+// LALE program of the served slot, removed again for the menu.
+const pio_program_t *laleServed;
+#endif
+
+#ifndef PAGE_TABLE
+// Address console address 0 is read from in the served window.
+uint32_t servedBase;
+#endif
+
+#ifdef RESET_DETECT
+#ifndef MENU_RETURN
+#error "RESET_DETECT switches images like MENU_RETURN does, enable that too."
+#endif
+#ifdef LOW_POWER
+#error "RESET_DETECT has to see the first read after the bus was quiet, LOW_POWER sleeps through it."
+#endif
+#if !defined( TABLE_SWITCH ) || defined( PAGE_CACHE )
+#error "RESET_DETECT switches while the BIOS reads, which only the one word push of TABLE_SWITCH can do."
+#endif
+
+// What a console restart gets: the menu, or the slot served before the menu.
+#define RESET_TO_MENU 0
+#define RESET_TO_GAME 1
+#define RESET_POLICY RESET_TO_MENU
+
+// Quiet for this long and then a read of "MN" or the reset jump is the BIOS
+// starting over. The IRQ jumps follow from 0x2108, a game woken up from sleep
+// comes back through those.
+#define RESET_IDLE_US 1000000
+// Longest a poll waits for that read, the other polls run in between.
+#define RESET_WAIT_US 1000
+// The DMA registers share the bus with the PIO FIFOs, look at them only this often.
+#define RESET_POLL_US 100
+#define RESET_START 0x2100
+#define RESET_END   0x2108
+
+int resetDataDma;
+uint32_t resetLastAddr;
+uint32_t resetLastSeen;
+uint32_t resetLastPoll;
+
+// Slot served last, -1 before the first pick.
+int servedSlot = -1;
+
+// Restarts seen, read out with a debugger.
+volatile uint32_t resetCount;
+
+// Goes with the slot switching further down, called by the serving loops.
+void resetPoll( void );
+#endif
+
+#ifdef SAVE_WINDOW
+#if !defined( TABLE_SWITCH ) || defined( PAGE_CACHE )
+#error "SAVE_WINDOW is mapped through the TABLE_SWITCH page table and takes core1, which PAGE_CACHE uses."
+#endif
+
+#include <string.h>
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+
+// Window size and its pages in the table. A game using it has to stay below
+// SAVE_FIRST_PAGE * PAGE_SIZE.
+#define SAVE_BITS 13
+#define SAVE_SIZE ( 1u << SAVE_BITS )
+#define SAVE_PAGES ( SAVE_SIZE / PAGE_SIZE )
+#define SAVE_FIRST_PAGE ( PAGE_COUNT - SAVE_PAGES )
+#define SAVE_SECTORS ( SAVE_SIZE / FLASH_SECTOR_SIZE )
+
+// Writes caught but not applied yet, a power of two.
+#define SAVE_RING_BITS 10
+#define SAVE_RING_ENTRIES ( 1u << SAVE_RING_BITS )
+
+// Quiet time on the bus before dirty sectors are written.
+#define SAVE_IDLE_US 100000
+
+// Save areas of SAVE_SIZE for each of the SLOTDIR_MAX slots, reserved in the
+// linker script.
+extern uint8_t __saves_start[];
+extern uint8_t __saves_end[];
+
+uint8_t saveBuffer[ SAVE_SIZE ] __attribute__ ((section(".romSRAM"), aligned( PAGE_SIZE )));
+
+// For every write on the bus: the address data_dma read in that cycle and the
+// data byte, filled by save_addr_dma and save_data_dma.
+uint32_t saveAddr[ SAVE_RING_ENTRIES ] __attribute__ ((section(".romSRAM"), aligned( SAVE_RING_ENTRIES * 4 )));
+uint32_t saveData[ SAVE_RING_ENTRIES ] __attribute__ ((section(".romSRAM"), aligned( SAVE_RING_ENTRIES * 4 )));
+
+int saveDataDma;
+int saveRingDma;
+
+// Next ring entry core1 looks at.
+volatile uint32_t saveTail;
+
+// Sectors of saveBuffer changed since they were written. Set by core1,
+// cleared by core0, one byte each so neither has to lock.
+volatile uint8_t saveDirty[ SAVE_SECTORS ];
+
+// Slot the buffer belongs to, -1 if it isn't written back.
+int saveSlot = -1;
+
+int saveBusDma;
+uint32_t saveLastAddr;
+uint32_t saveLastSeen;
+
+// Writes lost because the ring was full, read out with a debugger.
+volatile uint32_t saveOverruns;
+
+// Goes with the slot switching further down, called by the serving loops.
+void savePoll( void );
+#endif
+
+#ifdef FLASH_TUNING
+#include "hardware/structs/ssi.h"
+#include "hardware/structs/xip_ctrl.h"
+#include "hardware/sync.h"
+
+// W25Q128JV limit for the quad I/O fast read.
+#define FLASH_MAX_SCK_KHZ 133000
+
+// Continuous read as set up by boot2_w25q080: after the first EBh command every
+// transfer is 6 address + 2 mode + 4 dummy + 8 data clocks, no command phase.
+#define FLASH_MODE_CONTINUOUS 0xA0
+#define FLASH_WAIT_CYCLES 4
+
+// Words compared after retuning, spread over the first 1 MB of flash.
+#define FLASH_VERIFY_WORDS 256
+#define FLASH_VERIFY_STRIDE 1021
+
+// SSI settings in use after the boot check, read out with a debugger.
+volatile uint32_t flashClkDiv;
+volatile uint32_t flashRxDelay;
+volatile bool flashTuned;
+
+uint32_t flashRef[ FLASH_VERIFY_WORDS ];
+#endif
+
+
+// We don't use the Flash cache, unless XIP_CACHED is set.
+#define XIP_CACHE   0x10000000
+#define XIP_NOCACHE 0x13000000
+#define XIP_NOCACHE_OFFSET (XIP_NOCACHE - XIP_CACHE)
+
+// Offset from a ROM in flash to the alias data_dma reads it through.
+#ifdef XIP_CACHED
+#define ROM_XIP_OFFSET 0
+#else
+#define ROM_XIP_OFFSET XIP_NOCACHE_OFFSET
+#endif
+
+// Pin Definitions.
+#define A0A10 0
+#define A1A11 1
+#define A2A12 2
+#define A3A13 3
+#define A4A14 4
+#define A5A15 5
+#define A6A16 6
+#define A7A17 7
+#define A8A18 8
+#define A9A19 9
+#define A20 10
+
+#define D0 17
+#define D1 18
+#define D2 19
+#define D3 20
+#define D4 21
+#define D5 22
+#define D6 23
+#define D7 24
+
+#define HALE 11
+#define LALE 12
+#define WE 13
+#define OE 14
+#define CS 15
+
+#if defined( MEASURE_DMA_LATENCY ) && defined( MULTICART )
+// Wait through SIO, off the bus the DMA serves over, for pin to be at level.
+// False once SWITCH_WAIT_US have passed since since.
+static inline bool switchPinWait( uint32_t pin, bool level, uint32_t since ) {
+  while ( ( ( sio_hw->gpio_in >> pin ) & 1u ) != level ) {
+    if ( timer_hw->timerawl - since >= SWITCH_WAIT_US ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Time a switch up to the first read latched after it: an edge of latch (HALE
+// or LALE), then OE.
+void __not_in_flash_func( switchTimed )( uint32_t latch, uint32_t gapStart ) {
+  uint32_t asked = switchAskedUs;
+  uint32_t now = timer_hw->timerawl;
+
+  if ( asked == 0 ) {
+    return;
+  }
+  switchAskedUs = 0;
+
+  if ( !switchPinWait( latch, false, now ) || !switchPinWait( latch, true, now ) || !switchPinWait( OE, true, now ) ) {
+    // The console isn't reading.
+    return;
+  }
+  switchGapCycles = ( gapStart - systick_hw->cvr ) & 0x00FFFFFF;
+  switchTotalUs = timer_hw->timerawl - asked;
+}
+#endif
+
+#ifdef SRAM_SERVING
+// Copy a ROM into the SRAM window and clear the rest of it.
+void __not_in_flash_func( copyToSRAM )( const uint8_t *src, uint32_t len ) {
+  int ch = dma_claim_unused_channel( true );
+  dma_channel_config c = dma_channel_get_default_config( ch );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, true );
+  channel_config_set_write_increment( &c, true );
+
+  len = ( len + 3 ) & ~3u;
+  dma_channel_configure( ch, &c, romSRAM, src, len / 4, true );
+  dma_channel_wait_for_finish_blocking( ch );
+  dma_channel_unclaim( ch );
+
+  memset( romSRAM + len, 0, SRAM_ROM_SIZE - len );
+}
+
+#ifdef MULTICART
+// Read a length continuation (bytes of 255 add up until a smaller one).
+static inline bool lz4Length( const uint8_t **src, const uint8_t *end, uint32_t *len ) {
+  uint32_t b;
+
+  do {
+    if ( *src >= end ) {
+      return false;
+    }
+    b = *( *src )++;
+    *len += b;
+  } while ( b == 255 );
+
+  return true;
+}
+
+// Unpack an LZ4 block into the SRAM copy and clear the rest of it. Returns the
+// unpacked size, 0 if the data is broken or doesn't fit.
+uint32_t __not_in_flash_func( unpackToSRAM )( const uint8_t *src, uint32_t len ) {
+  const uint8_t *end = src + len;
+  uint8_t *out = romSRAM;
+  uint8_t *outEnd = romSRAM + SRAM_ROM_SIZE;
+
+  while ( src < end ) {
+    uint32_t token = *src++;
+
+    // Literals.
+    uint32_t n = token >> 4;
+    if ( n == 15 && !lz4Length( &src, end, &n ) ) {
+      return 0;
+    }
+    if ( n > (uint32_t) ( end - src ) || n > (uint32_t) ( outEnd - out ) ) {
+      return 0;
+    }
+    memcpy( out, src, n );
+    out += n;
+    src += n;
+
+    // The last sequence has no match.
+    if ( src == end ) {
+      break;
+    }
+
+    // Match.
+    if ( end - src < 2 ) {
+      return 0;
+    }
+    uint32_t offset = src[ 0 ] | ( src[ 1 ] << 8 );
+    src += 2;
+    if ( offset == 0 || offset > (uint32_t) ( out - romSRAM ) ) {
+      return 0;
+    }
+
+    n = token & 15;
+    if ( n == 15 && !lz4Length( &src, end, &n ) ) {
+      return 0;
+    }
+    n += 4;
+    if ( n > (uint32_t) ( outEnd - out ) ) {
+      return 0;
+    }
+
+    // Byte by byte, the match may overlap what it produces (runs of padding).
+    const uint8_t *match = out - offset;
+    while ( n-- ) {
+      *out++ = *match++;
+    }
+  }
+
+  len = out - romSRAM;
+  memset( out, 0, SRAM_ROM_SIZE - len );
+  return len;
+}
+
+// Slots are zero padded, so the ROM ends at the last non-zero word.
+uint32_t __not_in_flash_func( romUsedSize )( const uint8_t *slot, uint32_t size ) {
+  const uint32_t *w = (const uint32_t *) slot;
+  uint32_t n = size / 4;
+
+  while ( n > 0 && w[ n - 1 ] == 0 ) {
+    --n;
+  }
+
+  return n * 4;
+}
+#endif
+#endif
+
+#ifdef PAGE_TABLE
+// Point all pages of the table not served at a ROM, repeating it every romPages
+// pages, and empty the pool. romAddress is the address to serve from (flash alias
+// or SRAM).
+void pageMap( uint32_t romAddress, uint32_t romPages ) {
+  pageTable = ( pageTable == pageTables[ 0 ] ) ? pageTables[ 1 ] : pageTables[ 0 ];
+
+  for ( uint32_t p = 0; p < PAGE_COUNT; ++p ) {
+    pageHome[ p ] = ( romAddress + ( p % romPages ) * PAGE_SIZE ) >> PAGE_BITS;
+    pageTable[ p ] = pageHome[ p ];
+    #ifdef PAGE_CACHE
+    pageSlot[ p ] = -1;
+    #endif
+  }
+
+  #ifdef PAGE_CACHE
+  for ( uint32_t i = 0; i < POOL_PAGES; ++i ) {
+    poolOwner[ i ] = PAGE_COUNT;
+    poolUsed[ i ] = 0;
+    poolAhead[ i ] = 0;
+  }
+  poolHand = 0;
+  #endif
+}
+
+// Hand the table pageMap() built to the HALE SM. It takes the new base with the
+// next HALE, so every read goes through either the old table or the new one.
+void __not_in_flash_func( pageTableServe )( void ) {
+  #ifdef MEASURE_DMA_LATENCY
+  uint32_t start = systick_hw->cvr;
+  #endif
+
+  pio_sm_put( pio0, tableSm, ( (uint32_t) pageTable ) >> 13 );
+
+  #if defined( MEASURE_DMA_LATENCY ) && defined( MULTICART )
+  // A read without HALE still goes through the old table.
+  switchTimed( HALE, start );
+  #endif
+}
+
+#ifdef MULTICART
+// Point all pages at a slot's 4 KB blocks instead, repeating the list like pageMap does.
+void pageMapBlocks( const volatile uint16_t *blocks, uint32_t count ) {
+  const uint32_t blockPages = BLOCK_SIZE / PAGE_SIZE;
+
+  pageMap( (uint32_t) rom + ROM_XIP_OFFSET, count * blockPages );
+
+  for ( uint32_t p = 0; p < PAGE_COUNT; ++p ) {
+    uint32_t b = blocks[ ( p / blockPages ) % count ];
+    pageHome[ p ] = ( (uint32_t) rom + ROM_XIP_OFFSET + b * BLOCK_SIZE + ( p % blockPages ) * PAGE_SIZE ) >> PAGE_BITS;
+    pageTable[ p ] = pageHome[ p ];
+  }
+}
+
+// Same 32 KB window as lale_menu.pio, no caching for the menu.
+void menuPageMap( void ) {
+  pageMap( (uint32_t) rom_menu + ROM_XIP_OFFSET, 32 );
+
+  #ifdef BUS_COUNTERS
+  // Status block over the last page of each window.
+  statusBlock = (volatile counters_t *) statusPage;
+  for ( uint32_t p = STATUS_OFFSET >> PAGE_BITS; p < PAGE_COUNT; p += 32 ) {
+    pageTable[ p ] = ( (uint32_t) statusPage ) >> PAGE_BITS;
+  }
+  #endif
+
+  #ifdef SLOT_METADATA
+  for ( uint32_t p = META_OFFSET >> PAGE_BITS; p < PAGE_COUNT; p += 32 ) {
+    for ( uint32_t i = 0; i < META_SIZE / PAGE_SIZE; ++i ) {
+      pageTable[ p + i ] = ( (uint32_t) metaPage >> PAGE_BITS ) + i;
+    }
+  }
+  #endif
+}
+#endif
+#endif
+
+#ifdef PAGE_CACHE
+
+// Load page p into pool entry i and serve it from there.
+void __not_in_flash_func( pageFill )( uint32_t p, uint32_t i ) {
+  uint32_t old = poolOwner[ i ];
+
+  if ( old < PAGE_COUNT ) {
+    // Send the old page back to flash and let a lookup in flight finish with it.
+    pageTable[ old ] = pageHome[ old ];
+    pageSlot[ old ] = -1;
+    uint32_t t = timer_hw->timerawl;
+    while ( timer_hw->timerawl - t < 2 ) {
+      tight_loop_contents();
+    }
+  }
+
+  // Copy through the cached alias, it fetches 8 bytes per flash access.
+  memcpy( pagePool + i * PAGE_SIZE, (const void *) ( ( pageHome[ p ] << PAGE_BITS ) - XIP_NOCACHE_OFFSET ), PAGE_SIZE );
+  __dmb();
+
+  pageTable[ p ] = ( (uint32_t) pagePool + i * PAGE_SIZE ) >> PAGE_BITS;
+  pageSlot[ p ] = i;
+  poolOwner[ i ] = p;
+  poolUsed[ i ] = 1;
+  poolAhead[ i ] = 0;
+}
+
+// Clock replacement: skip entries used since the hand last passed. Never takes
+// the entry of page keep (the one the console runs from) or of the page the
+// latest lookup fetched: reads that don't start a new HALE lookup go on with
+// that base, the wait in pageFill() doesn't cover them.
+uint32_t __not_in_flash_func( poolVictim )( uint32_t keep ) {
+  while ( 1 ) {
+    uint32_t i = poolHand;
+    poolHand = ( poolHand + 1 ) % POOL_PAGES;
+
+    if ( poolUsed[ i ] ) {
+      poolUsed[ i ] = 0;
+      continue;
+    }
+
+    uint32_t current = ( dma_hw->ch[ lookup_dma ].read_addr - (uint32_t) pageTable ) / 4;
+    if ( poolOwner[ i ] != keep && poolOwner[ i ] != current ) {
+      return i;
+    }
+  }
+}
+
+// Core1: follow the page the lookup DMA fetched last and pull missing pages into the pool.
+// The pins are watched through SIO, off the bus the DMA serves over: lookup_dma
+// is only read once per HALE, after OE shows that the lookup is done.
+void __not_in_flash_func( pageCacheLoop )( void ) {
+  uint32_t last = PAGE_COUNT;
+
+  while ( 1 ) {
+    while ( sio_hw->gpio_in & ( 1u << HALE ) ) {
+      tight_loop_contents();
+    }
+    while ( !( sio_hw->gpio_in & ( 1u << HALE ) ) ) {
+      tight_loop_contents();
+    }
+    while ( !( sio_hw->gpio_in & ( 1u << OE ) ) ) {
+      tight_loop_contents();
+    }
+
+    uint32_t p = ( dma_hw->ch[ lookup_dma ].read_addr - (uint32_t) pageTable ) / 4;
+    if ( p >= PAGE_COUNT || p == last ) {
+      continue;
+    }
+    bool sequential = ( p == last + 1 );
+    last = p;
+
+    if ( pageSlot[ p ] >= 0 ) {
+      uint32_t i = pageSlot[ p ];
+      poolUsed[ i ] = 1;
+      if ( poolAhead[ i ] ) {
+        poolAhead[ i ] = 0;
+        ++prefetchHits;
+      }
+      ++cacheHits;
+    } else {
+      ++cacheMisses;
+      pageFill( p, poolVictim( p ) );
+    }
+
+    // Code running off the end of a page goes on with the next one,
+    // so get that into SRAM before the console reaches it.
+    if ( sequential && p + 1 < PAGE_COUNT && pageSlot[ p + 1 ] < 0 ) {
+      uint32_t i = poolVictim( p );
+      pageFill( p + 1, i );
+      poolAhead[ i ] = 1;
+      ++prefetchIssued;
+    }
+  }
+}
+
+// Preload the start of the mapped ROM (header, vectors), serve the table and
+// let core1 handle the rest.
+void pageCacheRun( uint32_t romPages ) {
+  for ( uint32_t i = 0; i < POOL_PAGES && i < romPages; ++i ) {
+    pageFill( i, i );
+  }
+
+  pageTableServe();
+  multicore_launch_core1( pageCacheLoop );
+}
+
+// Map a ROM in flash and start caching it.
+void pageCacheStart( uint32_t romAddress, uint32_t romPages ) {
+  pageMap( romAddress + XIP_NOCACHE_OFFSET, romPages );
+  pageCacheRun( romPages );
+}
+#endif
+
+#ifdef MEASURE_DMA_LATENCY
+// Time single byte DMA reads from random addresses, the way data_dma reads the ROM.
+void __not_in_flash_func( measureLatency )( volatile latency_t *res, const uint8_t *base, uint32_t size ) {
+  static uint8_t sink;
+  int ch = dma_claim_unused_channel( true );
+  dma_channel_config c = dma_channel_get_default_config( ch );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_8 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, false );
+  channel_config_set_high_priority( &c, true );
+
+  dma_channel_configure( ch, &c, &sink, base, 1, false );
+
+  // Free running SysTick on the processor clock.
+  systick_hw->rvr = 0x00FFFFFF;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0x5;
+
+  uint32_t seed = 0x2100;
+  uint32_t min = 0xFFFFFFFF;
+  uint32_t max = 0;
+  uint32_t sum = 0;
+
+  for ( uint32_t i = 0; i < LATENCY_SAMPLES; ++i ) {
+    seed = seed * 1664525u + 1013904223u;
+    const uint8_t *addr = base + ( ( seed >> 8 ) % size );
+
+    uint32_t start = systick_hw->cvr;
+    dma_hw->ch[ ch ].al3_read_addr_trig = (uint32_t) addr;
+    while ( dma_hw->ch[ ch ].ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS ) {
+      tight_loop_contents();
+    }
+    uint32_t cycles = ( start - systick_hw->cvr ) & 0x00FFFFFF;
+
+    sum += cycles;
+    if ( cycles < min ) min = cycles;
+    if ( cycles > max ) max = cycles;
+  }
+
+  dma_channel_unclaim( ch );
+
+  res->min = min;
+  res->avg = sum / LATENCY_SAMPLES;
+  res->max = max;
+}
+#endif
+
+#ifdef XIP_CACHED
+// Empty the cache and pin the header of the ROM at romAddress in it. The other
+// lines stay a normal cache. Pinned lines go away with the next flush.
+void __not_in_flash_func( pinROMHeader )( const uint8_t *romAddress ) {
+  pinnedROM = romAddress;
+  xip_ctrl_hw->flush = 1;
+  (void) xip_ctrl_hw->flush;
+
+  // A write to the cached alias allocates and pins the line, so write back
+  // what is in flash. Whole words cover each 8 byte line completely.
+  for ( uint32_t a = PIN_START; a < PIN_END; a += 4 ) {
+    uint32_t w = *(const volatile uint32_t *) ( romAddress + XIP_NOCACHE_OFFSET + a );
+    *(volatile uint32_t *) ( romAddress + a ) = w;
+  }
+}
+#endif
+
+#ifdef FLASH_TUNING
+// Read the verify pattern through the uncached alias with the current settings.
+bool __no_inline_not_in_flash_func( flashCompare )( bool store ) {
+  const volatile uint32_t *flash = (const volatile uint32_t *) XIP_NOCACHE_NOALLOC_BASE;
+  bool ok = true;
+
+  for ( uint32_t i = 0; i < FLASH_VERIFY_WORDS; ++i ) {
+    uint32_t w = flash[ i * FLASH_VERIFY_STRIDE ];
+    if ( store ) {
+      flashRef[ i ] = w;
+    } else if ( w != flashRef[ i ] ) {
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+// Switch the SSI to continuous quad reads at clkdiv / rxdly and check the flash
+// still reads back the same. Puts the old settings back if it doesn't.
+// Runs from RAM with interrupts off, nothing may touch XIP meanwhile.
+bool __no_inline_not_in_flash_func( flashTry )( uint32_t clkdiv, uint32_t rxdly ) {
+  uint32_t irq = save_and_disable_interrupts();
+
+  uint32_t baudr = ssi_hw->baudr;
+  uint32_t dly = ssi_hw->rx_sample_dly;
+  uint32_t ctrlr0 = ssi_hw->ctrlr0;
+  uint32_t spi_ctrlr0 = ssi_hw->spi_ctrlr0;
+
+  ssi_hw->ssienr = 0;
+  ssi_hw->baudr = clkdiv;
+  ssi_hw->rx_sample_dly = rxdly;
+  ssi_hw->ctrlr0 = ( SSI_CTRLR0_SPI_FRF_VALUE_QUAD << SSI_CTRLR0_SPI_FRF_LSB ) |
+                   ( 31 << SSI_CTRLR0_DFS_32_LSB ) |
+                   ( SSI_CTRLR0_TMOD_VALUE_EEPROM_READ << SSI_CTRLR0_TMOD_LSB );
+  ssi_hw->spi_ctrlr0 = ( FLASH_MODE_CONTINUOUS << SSI_SPI_CTRLR0_XIP_CMD_LSB ) |
+                       ( 8 << SSI_SPI_CTRLR0_ADDR_L_LSB ) |
+                       ( FLASH_WAIT_CYCLES << SSI_SPI_CTRLR0_WAIT_CYCLES_LSB ) |
+                       ( SSI_SPI_CTRLR0_INST_L_VALUE_NONE << SSI_SPI_CTRLR0_INST_L_LSB ) |
+                       ( SSI_SPI_CTRLR0_TRANS_TYPE_VALUE_2C2A << SSI_SPI_CTRLR0_TRANS_TYPE_LSB );
+  ssi_hw->ssienr = 1;
+
+  bool ok = flashCompare( false );
+
+  if ( !ok ) {
+    ssi_hw->ssienr = 0;
+    ssi_hw->baudr = baudr;
+    ssi_hw->rx_sample_dly = dly;
+    ssi_hw->ctrlr0 = ctrlr0;
+    ssi_hw->spi_ctrlr0 = spi_ctrlr0;
+    ssi_hw->ssienr = 1;
+  }
+
+  // Drop lines the cache fetched while testing.
+  xip_ctrl_hw->flush = 1;
+  (void) xip_ctrl_hw->flush;
+
+  restore_interrupts( irq );
+  return ok;
+}
+
+// Pick the fastest divider the flash allows at the current system clock.
+// Only done when boot2 already left the flash in continuous read mode, leaving
+// and entering that mode again can't be undone safely if the check fails.
+void flashTune( void ) {
+  flashClkDiv = ssi_hw->baudr;
+  flashRxDelay = ssi_hw->rx_sample_dly;
+  flashTuned = false;
+
+  uint32_t inst = ( ssi_hw->spi_ctrlr0 & SSI_SPI_CTRLR0_INST_L_BITS ) >> SSI_SPI_CTRLR0_INST_L_LSB;
+  uint32_t mode = ( ssi_hw->spi_ctrlr0 & SSI_SPI_CTRLR0_XIP_CMD_BITS ) >> SSI_SPI_CTRLR0_XIP_CMD_LSB;
+  if ( inst != SSI_SPI_CTRLR0_INST_L_VALUE_NONE || mode != FLASH_MODE_CONTINUOUS ) {
+    return;
+  }
+
+  // Reference read with the boot2 settings.
+  flashCompare( true );
+
+  // The divider must be even.
+  uint32_t khz = clock_get_hz( clk_sys ) / 1000;
+  uint32_t div = 2;
+  while ( khz / div > FLASH_MAX_SCK_KHZ ) {
+    div += 2;
+  }
+
+  // Step down to the boot2 divider, or just the fastest allowed one if that is slower.
+  uint32_t last = ( div > flashClkDiv ) ? div : flashClkDiv;
+  for ( ; div <= last; div += 2 ) {
+    // One cycle late sampling is what boot2 uses at div 2, try later too.
+    for ( uint32_t dly = 1; dly <= 2; ++dly ) {
+      if ( flashTry( div, dly ) ) {
+        flashClkDiv = div;
+        flashRxDelay = dly;
+        flashTuned = true;
+        return;
+      }
+    }
+  }
+}
+#endif
+
+#ifdef CLOCK_CALIBRATION
+// Go with the slot lookup further down.
+#ifdef MULTICART
+uint32_t slotLookup( uint32_t n, uint32_t *bits );
+#ifdef SRAM_SERVING
+bool slotInSRAM( uint32_t n );
+#endif
+#endif
+
+// Changing the build options or the ROM starts calibration over.
+uint32_t calKey( void ) {
+  #ifndef MULTICART
+  uint32_t key = sizeof( rom );
+  for ( uint32_t a = 0x2100; a < 0x2200 && a < sizeof( rom ); ++a ) {
+    key = ( key ^ rom[ a ] ) * 16777619u;
+  }
+  #else
+  uint32_t key = ROMSIZE;
+  #endif
+  #ifdef SRAM_SERVING
+  key ^= 1u << 0;
+  #endif
+  #ifdef SINGLE_SM_ADDR
+  key ^= 1u << 1;
+  #endif
+  #ifdef XIP_CACHED
+  key ^= 1u << 2;
+  #endif
+  #ifdef FLASH_TUNING
+  key ^= 1u << 3;
+  #endif
+  #ifdef PAGE_TABLE
+  key ^= 1u << 4;
+  #endif
+  return key;
+}
+
+// Serving class: from SRAM, or through XIP with a window of up to 128 KB,
+// 256 KB, ... 2 MB. A larger window misses the XIP cache more often.
+#define CAL_CLASS_SRAM 0
+#define CAL_FLASH_MIN_BITS 17
+#define CAL_FLASH_MAX_BITS 21
+
+_Static_assert( 1 + CAL_FLASH_MAX_BITS - CAL_FLASH_MIN_BITS < SETTINGS_CLASSES, "More serving classes than settings has room for" );
+
+uint32_t calClass( bool fromSRAM, uint32_t bits ) {
+  if ( fromSRAM ) {
+    return CAL_CLASS_SRAM;
+  }
+  if ( bits < CAL_FLASH_MIN_BITS ) bits = CAL_FLASH_MIN_BITS;
+  if ( bits > CAL_FLASH_MAX_BITS ) bits = CAL_FLASH_MAX_BITS;
+  return 1 + bits - CAL_FLASH_MIN_BITS;
+}
+
+// Class of what is served from power-up, the one measured on this boot.
+uint32_t calBootClass( void ) {
+  #ifndef MULTICART
+  #ifdef SRAM_SERVING
+  if ( sizeof( rom ) <= SRAM_ROM_SIZE ) {
+    return CAL_CLASS_SRAM;
+  }
+  #endif
+  return calClass( false, 32 - __builtin_clz( sizeof( rom ) - 1 ) );
+  #else
+  if ( bootSlot >= 0 ) {
+    uint32_t bits;
+    #ifdef SRAM_SERVING
+    if ( slotInSRAM( bootSlot ) ) {
+      return CAL_CLASS_SRAM;
+    }
+    #endif
+    // A block list can span the largest window.
+    if ( slotLookup( bootSlot, &bits ) == 0 ) {
+      bits = SLOT_MAX_BITS;
+    }
+    return calClass( false, bits );
+  }
+  #ifdef MENU_SRAM
+  return CAL_CLASS_SRAM;
+  #else
+  return calClass( false, 15 );
+  #endif
+  #endif
+}
+
+// Pair a class passed, the first one if it wasn't calibrated.
+static inline uint32_t calGoodPair( uint32_t cls ) {
+  uint8_t pair = settings.cls[ cls ].clockPair;
+  return ( pair == SETTINGS_NONE ) ? 0 : pair;
+}
+
+#ifdef MULTICART
+// Lowest pair the classes of all slots passed, leaving class skip out. A
+// window larger than the SRAM copy is taken as served from flash, the ROM in
+// it may be smaller but finding out means reading all of it.
+uint32_t calSlotsPair( uint32_t skip ) {
+  uint32_t classes = 0;
+  uint32_t pair = CLOCK_PAIRS - 1;
+
+  if ( slotDir.count == 0 ) {
+    classes |= 1u << calClass( false, ROMSIZE_BITS );
+  }
+  for ( uint32_t n = 0; n < slotDir.count && n < SLOTDIR_MAX; ++n ) {
+    uint32_t bits;
+    if ( slotDir.slot[ n ].size == 0 ) {
+      continue;
+    }
+    if ( slotLookup( n, &bits ) == 0 ) {
+      bits = SLOT_MAX_BITS;
+    }
+    #ifdef SRAM_SERVING
+    if ( slotDir.slot[ n ].packed != 0 || ( 1u << bits ) <= SRAM_ROM_SIZE ) {
+      classes |= 1u << CAL_CLASS_SRAM;
+      continue;
+    }
+    #endif
+    classes |= 1u << calClass( false, bits );
+  }
+  #ifdef MENU_SRAM
+  classes |= 1u << CAL_CLASS_SRAM;
+  #else
+  classes |= 1u << calClass( false, 15 );
+  #endif
+
+  for ( uint32_t c = 0; c < SETTINGS_CLASSES; ++c ) {
+    if ( c != skip && ( classes & ( 1u << c ) ) && calGoodPair( c ) < pair ) {
+      pair = calGoodPair( c );
+    }
+  }
+  return pair;
+}
+#endif
+
+// Decide the clock pair for this boot. A pair under test is written down
+// before serving starts, so a pair that crashes the console counts as failed.
+// Called once the boot slot is known.
+uint32_t calibrationStart( void ) {
+  uint32_t key = calKey();
+
+  if ( !settingsLoad( &settings ) || settings.calKey != key ) {
+    memset( &settings, 0, sizeof( settings ) );
+    settings.calKey = key;
+    for ( uint32_t c = 0; c < SETTINGS_CLASSES; ++c ) {
+      settings.cls[ c ].clockPair = SETTINGS_NONE;
+      settings.cls[ c ].trialPair = SETTINGS_NONE;
+    }
+  }
+
+  calBootCls = calBootClass();
+  settings_class_t *cls = &settings.cls[ calBootCls ];
+
+  // The other slots can follow through the menu.
+  uint32_t limit = CLOCK_PAIRS - 1;
+  #ifdef MULTICART
+  #ifndef MENU_RETURN
+  if ( bootSlot < 0 )
+  #endif
+  {
+    limit = calSlotsPair( calBootCls );
+  }
+  #endif
+
+  // The pass is written while nothing is served from flash, or at a pick.
+  bool writable = calBootCls == CAL_CLASS_SRAM;
+  #ifdef MULTICART
+  writable = writable || bootSlot < 0;
+  #endif
+
+  if ( !cls->calibrated && writable ) {
+    bool changed = true;
+    if ( cls->trialPair != SETTINGS_NONE ) {
+      // The last try never passed, stay with the pair before it.
+      cls->trialPair = SETTINGS_NONE;
+      cls->calibrated = 1;
+    } else {
+      uint32_t next = ( cls->clockPair == SETTINGS_NONE ) ? 0 : cls->clockPair + 1;
+      if ( next >= CLOCK_PAIRS ) {
+        cls->calibrated = 1;
+      } else if ( next <= limit ) {
+        cls->trialPair = next;
+        calibrating = true;
+      } else {
+        // Waits for the other classes to get there.
+        changed = false;
+      }
+    }
+    if ( changed ) {
+      // Nothing is served yet, so this can go to flash straight away.
+      settingsSave( &settings );
+      kvFlush();
+    }
+  }
+
+  if ( calibrating ) {
+    return cls->trialPair;
+  }
+  uint32_t pair = calGoodPair( calBootCls );
+  return ( pair < limit ) ? pair : limit;
+}
+
+// Time live read cycles: LALE high (address latched), data_dma done (from
+// stamp_dma) and OE high (data driven). Slack is OE minus data done.
+void __not_in_flash_func( measureSlack )( uint32_t khz ) {
+  io_ro_32 *ctr = &pwm_hw->slice[ CAL_PWM_SLICE ].ctr;
+  int32_t minSlack = INT32_MAX;
+  uint32_t maxService = 0;
+  uint32_t n = 0;
+  uint32_t start = timer_hw->timerawl;
+
+  while ( n < CAL_SAMPLES && timer_hw->timerawl - start < CAL_TIMEOUT_US ) {
+    if ( sio_hw->gpio_in & ( 1u << LALE ) ) {
+      continue;
+    }
+    calStamp = CAL_NO_STAMP;
+
+    uint32_t i = 0;
+    while ( !( sio_hw->gpio_in & ( 1u << LALE ) ) && ++i < 100000 ) {
+      tight_loop_contents();
+    }
+    uint32_t t0 = *ctr;
+
+    // No OE soon after means a write cycle, skip it.
+    for ( i = 0; !( sio_hw->gpio_in & ( 1u << OE ) ) && i < 1000; ++i ) {
+      tight_loop_contents();
+    }
+    uint32_t t2 = *ctr;
+    if ( i == 1000 ) {
+      continue;
+    }
+
+    for ( i = 0; calStamp == CAL_NO_STAMP && i < 1000; ++i ) {
+      tight_loop_contents();
+    }
+    uint32_t t1 = calStamp;
+    if ( t1 == CAL_NO_STAMP ) {
+      continue;
+    }
+
+    int32_t slack = (int16_t) ( t2 - t1 ) - CAL_POLL_CYCLES;
+    uint32_t service = ( t1 - t0 ) & 0xFFFF;
+    if ( slack < minSlack ) minSlack = slack;
+    if ( service > maxService ) maxService = service;
+    ++n;
+  }
+
+  calSampleCount = n;
+  calSlackMin = ( n > 0 ) ? (int32_t) ( (int64_t) minSlack * 1000000 / khz ) : 0;
+  calServiceMax = (uint32_t) ( (uint64_t) maxService * 1000000 / khz );
+}
+
+// Judge the pair under test. The result is written by storePoll() once nothing
+// is served from flash, or by the next pick; until then the next boot takes the
+// trial as a fail.
+void calibrationFinish( void ) {
+  measureSlack( clock_get_hz( clk_sys ) / 1000 );
+  if ( calSampleCount == 0 ) {
+    // Nothing to go by. The next boot takes the missing pass as a fail.
+    return;
+  }
+
+  settings_class_t *cls = &settings.cls[ calBootCls ];
+  if ( calSlackMin >= CAL_MARGIN_NS ) {
+    cls->clockPair = cls->trialPair;
+    cls->slackNs = ( calSlackMin > 255 ) ? 255 : calSlackMin;
+  } else {
+    cls->calibrated = 1;
+  }
+  cls->trialPair = SETTINGS_NONE;
+  settingsSave( &settings );
+  storeUrgent = true;
+}
+
+#ifdef SLOT_CHECK
+// The boot slot failed its check after calibrationStart(), the menu comes up
+// instead. Take the trial back, nothing is served yet.
+void calibrationCancel( void ) {
+  if ( !calibrating ) {
+    return;
+  }
+  settings.cls[ calBootCls ].trialPair = SETTINGS_NONE;
+  settingsSave( &settings );
+  kvFlush();
+  calibrating = false;
+}
+#endif
+#endif
+
+#ifdef BUS_COUNTERS
+// The glitch paths of the _count programs (hale.pio, lale.pio, ...) raise PIO IRQ 0 / 1.
+void __not_in_flash_func( glitchIRQ )( void ) {
+  uint32_t flags = pio0->irq;
+
+  if ( flags & 1u ) {
+    ++counters.glitchHale;
+  }
+  if ( flags & 2u ) {
+    ++counters.glitchLale;
+  }
+  pio0->irq = flags & 3u;
+}
+
+// FDEBUG flags are sticky, so each poll counts at most one event per kind.
+void __not_in_flash_func( countersPoll )( void ) {
+  uint32_t fdebug = pio0->fdebug;
+
+  counters.reads = dma_hw->sniff_data;
+  if ( countSmHale >= 0 && ( fdebug & ( 1u << ( PIO_FDEBUG_RXSTALL_LSB + countSmHale ) ) ) ) {
+    ++counters.stallHale;
+  }
+  if ( countSmLale >= 0 && ( fdebug & ( 1u << ( PIO_FDEBUG_RXSTALL_LSB + countSmLale ) ) ) ) {
+    ++counters.stallLale;
+  }
+  if ( countSmPush >= 0 && ( fdebug & ( 1u << ( PIO_FDEBUG_TXOVER_LSB + countSmPush ) ) ) ) {
+    ++counters.lostData;
+  }
+  pio0->fdebug = fdebug;
+
+  if ( statusBlock ) {
+    statusBlock->reads = counters.reads;
+    statusBlock->glitchHale = counters.glitchHale;
+    statusBlock->glitchLale = counters.glitchLale;
+    statusBlock->stallHale = counters.stallHale;
+    statusBlock->stallLale = counters.stallLale;
+    statusBlock->lostData = counters.lostData;
+    statusBlock->slotSwitches = counters.slotSwitches;
+    statusBlock->loadUs = counters.loadUs;
+  }
+}
+#endif
+
+#ifdef LOW_POWER
+// Sleep core0 in WFE for us microseconds. The alarm IRQ stays disabled in the
+// NVIC, with SEVONPEND becoming pending is enough to wake the core.
+void __not_in_flash_func( idleFor )( uint32_t us ) {
+  hw_set_bits( &timer_hw->inte, 1u << POWER_ALARM );
+  timer_hw->alarm[ POWER_ALARM ] = timer_hw->timerawl + us;
+  while ( timer_hw->armed & ( 1u << POWER_ALARM ) ) {
+    #ifdef MENU_RETURN
+    // The write check IRQ woke core0 with a switch to do.
+    if ( cmdPending != CMD_NONE ) {
+      break;
+    }
+    #endif
+    __wfe();
+  }
+  timer_hw->intr = 1u << POWER_ALARM;
+  irq_clear( TIMER_IRQ_0 + POWER_ALARM );
+}
+
+// Replaces the busy loop once serving runs. data_dma's read address stays put
+// while the console doesn't fetch (asleep, or halted between interrupts).
+void __not_in_flash_func( powerLoop )( int data_dma, int lale_addr_dma, int wake_dma ) {
+  uint32_t last = dma_hw->ch[ data_dma ].read_addr;
+  uint32_t quiet = 0;
+
+  scb_hw->scr |= M0PLUS_SCR_SEVONPEND_BITS;
+  hardware_alarm_claim( POWER_ALARM );
+
+  // Free running SysTick, counts the cycles core0 spends between sleeps.
+  systick_hw->rvr = 0x00FFFFFF;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0x5;
+  uint32_t woke = systick_hw->cvr;
+
+  while ( 1 ) {
+    powerAwakeCycles += ( woke - systick_hw->cvr ) & 0x00FFFFFF;
+    idleFor( POWER_POLL_US );
+    woke = systick_hw->cvr;
+
+    #ifdef BUS_COUNTERS
+    countersPoll();
+    #endif
+    #ifdef BOOT_TIMING
+    bootPoll();
+    #endif
+    #ifdef MENU_RETURN
+    // The write check IRQ wakes core0 for this.
+    commandPoll();
+    #endif
+    #ifdef KV_STORE
+    storePoll();
+    #endif
+    #ifdef SAVE_WINDOW
+    savePoll();
+    #endif
+
+    uint32_t addr = dma_hw->ch[ data_dma ].read_addr;
+    if ( addr != last ) {
+      last = addr;
+      quiet = 0;
+      continue;
+    }
+    quiet += POWER_POLL_US;
+    if ( quiet < POWER_IDLE_US ) {
+      continue;
+    }
+
+    // Let the wake channel take the next LALE instead of the LALE channel.
+    // EN is cleared first, aborting a channel may trigger its chain (RP2040-E13).
+    hw_clear_bits( &dma_hw->ch[ lale_addr_dma ].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS );
+    dma_channel_abort( lale_addr_dma );
+    hw_set_bits( &dma_hw->ch[ lale_addr_dma ].al1_ctrl, DMA_CH0_CTRL_TRIG_EN_BITS );
+    if ( dma_channel_is_busy( data_dma ) ) {
+      // A read slipped in, data_dma arms the LALE channel again.
+      quiet = 0;
+      continue;
+    }
+    dma_channel_start( wake_dma );
+    clocks_hw->clk[ clk_sys ].div = POWER_IDLE_DIV << CLOCKS_CLK_SYS_DIV_INT_LSB;
+    ++powerIdleEntries;
+
+    uint32_t start = timer_hw->timerawl;
+    while ( clocks_hw->clk[ clk_sys ].div != powerFullDiv ) {
+      idleFor( POWER_POLL_US );
+    }
+    powerIdleUs += timer_hw->timerawl - start;
+
+    last = dma_hw->ch[ data_dma ].read_addr;
+    quiet = 0;
+  }
+}
+#endif
+
+#ifdef USB_REPORTS
+#ifdef BUS_TRACE
+// Print the trace ring, oldest first. The trace channel is taken out of the
+// chain meanwhile, so the ring doesn't change under the dump.
+void traceDump( int data_dma, int trace_dma, int trace_next ) {
+  hw_write_masked( &dma_hw->ch[ data_dma ].al1_ctrl, trace_next << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB, DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS );
+  while ( dma_channel_is_busy( trace_dma ) ) {
+    tight_loop_contents();
+  }
+
+  uint32_t head = ( dma_hw->ch[ trace_dma ].write_addr - (uint32_t) traceAddr ) / 4;
+  printf( "trace %u\n", TRACE_ENTRIES );
+  for ( uint32_t n = 0; n < TRACE_ENTRIES; ++n ) {
+    uint32_t i = ( head + n ) % TRACE_ENTRIES;
+    if ( traceAddr[ i ] == 0 ) {
+      // Not written yet.
+      continue;
+    }
+    #ifdef BUS_TRACE_TIME
+    printf( "%08lx %lu\n", traceAddr[ i ], traceTime[ i ] );
+    #else
+    printf( "%08lx\n", traceAddr[ i ] );
+    #endif
+  }
+  printf( "end\n" );
+
+  hw_write_masked( &dma_hw->ch[ data_dma ].al1_ctrl, trace_dma << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB, DMA_CH0_CTRL_TRIG_CHAIN_TO_BITS );
+}
+#endif
+
+// Serve until reset, answering the host: 'd' dumps the trace, 'c' prints the counters,
+// 'b' the boot times.
+void usbLoop( int data_dma, int trace_dma, int trace_next ) {
+  while ( 1 ) {
+    // Short, a pick has to be served within the menu's wait.
+    int ch = getchar_timeout_us( 100 );
+
+    #ifdef BOOT_TIMING
+    bootPoll();
+    #endif
+    #ifdef MENU_RETURN
+    commandPoll();
+    #endif
+    #ifdef RESET_DETECT
+    resetPoll();
+    #endif
+    #ifdef KV_STORE
+    storePoll();
+    #endif
+    #ifdef SAVE_WINDOW
+    savePoll();
+    #endif
+
+    #ifdef BUS_COUNTERS
+    countersPoll();
+    if ( ch == 'c' ) {
+      printf( "reads %lu\nglitch hale %lu\nglitch lale %lu\nstall hale %lu\nstall lale %lu\nlost data %lu\nslot switches %lu\nload us %lu\n",
+              counters.reads, counters.glitchHale, counters.glitchLale, counters.stallHale,
+              counters.stallLale, counters.lostData, counters.slotSwitches, counters.loadUs );
+    }
+    #endif
+
+    #ifdef BUS_TRACE
+    if ( ch == 'd' ) {
+      traceDump( data_dma, trace_dma, trace_next );
+    }
+    #endif
+
+    #ifdef BOOT_TIMING
+    if ( ch == 'b' ) {
+      printf( "main %lu\nclock %lu\nserving %lu\nfirst read %lu\nfull clock %lu\n",
+              bootUs[ BOOT_MAIN ], bootUs[ BOOT_CLOCK ], bootUs[ BOOT_SERVING ],
+              bootUs[ BOOT_FIRST_READ ], bootUs[ BOOT_FULL_CLOCK ] );
+    }
+    #endif
+  }
+}
+#endif
+
+#if defined( KV_STORE ) || defined( SAVE_WINDOW )
+// Whether the console fetches any of the served image through XIP. A console
+// that wakes up while flash is written would read garbage from it then, however
+// long the bus was quiet before.
+bool servedFromFlash( void ) {
+  #ifdef PAGE_TABLE
+  for ( uint32_t p = 0; p < PAGE_COUNT; ++p ) {
+    if ( ( pageTable[ p ] << PAGE_BITS ) - XIP_BASE < SRAM_BASE - XIP_BASE ) {
+      return true;
+    }
+  }
+  return false;
+  #else
+  return servedBase - XIP_BASE < SRAM_BASE - XIP_BASE;
+  #endif
+}
+#endif
+
+#ifdef KV_STORE
+// Where storePoll() looks for reads. Also the start of the counter totals.
+void storeStart( int data_dma ) {
+  storeDataDma = data_dma;
+  storeLastAddr = dma_hw->ch[ data_dma ].read_addr;
+  storeLastSeen = timer_hw->timerawl;
+
+  #ifdef BUS_COUNTERS
+  kvGet( KV_COUNTERS, &countersBefore, sizeof( countersBefore ) );
+  ++countersBefore.boots;
+  countersStoredAt = storeLastSeen - COUNTERS_STORE_US;
+  #endif
+}
+
+// Write the changed values now. The console mustn't read flash meanwhile.
+void storeFlush( void ) {
+  if ( !kvDirty() ) {
+    return;
+  }
+
+  kvFlush();
+
+  // Writing flash put the SSI back on boot2's setup and flushed the cache.
+  #ifdef FLASH_TUNING
+  flashTune();
+  #endif
+  #ifdef XIP_CACHED
+  pinROMHeader( pinnedROM );
+  #endif
+}
+
+// Called from the serving loop. Writes changed values when the console hasn't
+// read for STORE_IDLE_US (asleep, or sitting in a menu) and nothing it could
+// wake up to is served from flash, which is gone while the sector is erased
+// and the page programmed. Otherwise they wait for the next pick (slotPick()).
+void storePoll( void ) {
+  uint32_t addr = dma_hw->ch[ storeDataDma ].read_addr;
+  uint32_t now = timer_hw->timerawl;
+
+  #ifdef LAST_SLOT
+  // Served long enough, this power-up doesn't count as a quick one.
+  if ( !lastSlotStable && now >= LAST_SLOT_STABLE_US ) {
+    uint8_t quick = 0;
+    kvSet( KV_QUICK_BOOTS, &quick, sizeof( quick ) );
+    lastSlotStable = true;
+    storeUrgent = true;
+  }
+  #endif
+
+  // The count of quick power-ups or a calibration pass has to be in flash before
+  // the cart loses power again. While a game is served from flash it waits for
+  // the next pick.
+  if ( storeUrgent && !servedFromFlash() ) {
+    storeUrgent = false;
+    storeFlush();
+    return;
+  }
+
+  if ( addr != storeLastAddr ) {
+    storeLastAddr = addr;
+    storeLastSeen = now;
+    return;
+  }
+  if ( now - storeLastSeen < STORE_IDLE_US ) {
+    return;
+  }
+
+  #ifdef BUS_COUNTERS
+  if ( kvDirty() || now - countersStoredAt >= COUNTERS_STORE_US ) {
+    counters_total_t total = countersBefore;
+    total.reads += counters.reads;
+    total.glitches += counters.glitchHale + counters.glitchLale;
+    total.lostData += counters.lostData;
+    total.slotSwitches += counters.slotSwitches;
+    kvSet( KV_COUNTERS, &total, sizeof( total ) );
+    countersStoredAt = now;
+  }
+  #endif
+
+  if ( kvDirty() && !servedFromFlash() ) {
+    storeFlush();
+  }
+}
+#endif
+
+#ifdef MULTICART
+// Flash address of slot n, and its window size in bits. The fixed slots if
+// there is no directory. 0 if the slot isn't a window in flash (packed, a block
+// list or a broken entry), the fixed address would be some other slot's data.
+uint32_t slotLookup( uint32_t n, uint32_t *bits ) {
+  if ( n < slotDir.count && n < SLOTDIR_MAX && slotDir.slot[ n ].blocks == 0 && slotDir.slot[ n ].packed == 0 ) {
+    uint32_t offset = slotDir.slot[ n ].offset;
+    uint32_t size = slotDir.slot[ n ].size;
+    uint32_t b = 31 - __builtin_clz( size | 1 );
+
+    if ( size == ( 1u << b ) && b >= SLOT_MIN_BITS && b <= SLOT_MAX_BITS &&
+         ( offset & ( size - 1 ) ) == 0 && offset + size <= sizeof( rom ) ) {
+      *bits = b;
+      return (uint32_t) rom + offset;
+    }
+  }
+
+  *bits = ROMSIZE_BITS;
+  if ( slotDir.count != 0 || n >= NUM_GAMES ) {
+    return 0;
+  }
+  return (uint32_t) rom + ROMSIZE * n;
+}
+
+#ifdef SRAM_SERVING
+// Compressed data of slot n, its length and unpacked size, or NULL if the slot
+// isn't compressed.
+const uint8_t *slotPacked( uint32_t n, uint32_t *packed, uint32_t *size ) {
+  if ( n >= slotDir.count || n >= SLOTDIR_MAX ) {
+    return NULL;
+  }
+
+  uint32_t offset = slotDir.slot[ n ].offset;
+  uint32_t len = slotDir.slot[ n ].packed;
+  if ( len == 0 || slotDir.slot[ n ].size > SRAM_ROM_SIZE ||
+       offset >= sizeof( rom ) || len > sizeof( rom ) - offset ) {
+    return NULL;
+  }
+
+  *packed = len;
+  *size = slotDir.slot[ n ].size;
+  return rom + offset;
+}
+
+// Whether slot n ends up in the SRAM copy (see slotToSRAM()), where flash
+// can be written while the game runs.
+bool slotInSRAM( uint32_t n ) {
+  uint32_t packedSize, unpackedSize;
+  uint32_t slotBits;
+
+  if ( slotPacked( n, &packedSize, &unpackedSize ) != NULL ) {
+    return true;
+  }
+  uint32_t romAddress = slotLookup( n, &slotBits );
+  return romAddress != 0 &&
+         romUsedSize( (const uint8_t *) romAddress, 1u << slotBits ) <= SRAM_ROM_SIZE;
+}
+#endif
+
+#ifdef PAGE_TABLE
+// Block list of slot n and its length, or NULL if the slot isn't a list.
+const volatile uint16_t *slotBlocks( uint32_t n, uint32_t *count ) {
+  if ( n >= slotDir.count || n >= SLOTDIR_MAX ) {
+    return NULL;
+  }
+
+  uint32_t first = slotDir.slot[ n ].offset;
+  uint32_t blocks = slotDir.slot[ n ].blocks;
+  if ( blocks == 0 || blocks > PAGE_COUNT * PAGE_SIZE / BLOCK_SIZE ||
+       first >= BLOCKMAP_MAX || blocks > BLOCKMAP_MAX - first ) {
+    return NULL;
+  }
+
+  for ( uint32_t i = 0; i < blocks; ++i ) {
+    if ( blockMap.block[ first + i ] >= sizeof( rom ) / BLOCK_SIZE ) {
+      return NULL;
+    }
+  }
+
+  *count = blocks;
+  return &blockMap.block[ first ];
+}
+#endif
+
+#ifdef SLOT_METADATA
+// Write what the menu shows into page: the titles from the patcher, the rest
+// from the slot directory and the ROM headers.
+void metaBuild( uint8_t *page ) {
+  meta_t *meta = (meta_t *) page;
+
+  metaServed = meta;
+  memset( page, 0, META_SIZE );
+  meta->magic = META_MAGIC;
+  meta->count = ( slotDir.count == 0 ) ? NUM_GAMES : slotDir.count;
+  if ( meta->count > META_SLOTS ) {
+    meta->count = META_SLOTS;
+  }
+
+  for ( uint32_t n = 0; n < meta->count; ++n ) {
+    meta_slot_t *m = &meta->slot[ n ];
+
+    for ( uint32_t i = 0; i < META_TITLE - 1; ++i ) {
+      m->title[ i ] = slotNames.title[ n ][ i ];
+    }
+    if ( m->title[ 0 ] == '\0' ) {
+      continue;
+    }
+
+    // Game code in the ROM header, only readable in place if the slot isn't packed.
+    const uint8_t *code = NULL;
+    if ( slotDir.count == 0 ) {
+      m->size = ROMSIZE;
+      code = rom + ROMSIZE * n + META_CODE;
+    } else if ( slotDir.slot[ n ].packed != 0 ) {
+      m->size = slotDir.slot[ n ].size;
+    } else if ( slotDir.slot[ n ].blocks != 0 ) {
+      m->size = slotDir.slot[ n ].blocks * BLOCK_SIZE;
+      #ifdef PAGE_TABLE
+      uint32_t count;
+      const volatile uint16_t *blocks = slotBlocks( n, &count );
+      if ( blocks != NULL && count > META_CODE / BLOCK_SIZE ) {
+        code = rom + blocks[ META_CODE / BLOCK_SIZE ] * BLOCK_SIZE + META_CODE % BLOCK_SIZE;
+      }
+      #endif
+    } else {
+      uint32_t bits;
+      m->size = slotDir.slot[ n ].size;
+      uint32_t slot = slotLookup( n, &bits );
+      code = ( slot != 0 ) ? (const uint8_t *) slot + META_CODE : NULL;
+    }
+
+    for ( uint32_t i = 0; i < 4; ++i ) {
+      m->code[ i ] = ( code != NULL ) ? code[ i ] : ' ';
+    }
+
+    #ifdef SLOT_CHECK
+    // A boot slot is checked before the menu is built.
+    m->bad = slotState[ n ] == SLOT_BAD;
+    #endif
+  }
+}
+#endif
+
+#ifdef SLOT_METADATA
+// Show slot n as bad in the menu, from its next start.
+void metaMarkBad( uint32_t n ) {
+  if ( metaServed != NULL && n < metaServed->count ) {
+    metaServed->slot[ n ].bad = 1;
+  }
+}
+#endif
+
+#ifdef SLOT_CHECK
+// Stream len bytes of flash at addr through the XIP stream FIFO and the
+// sniffer, which keeps adding to its CRC. Only the DMA reads the data.
+void slotCheckStream( int ch, const uint8_t *addr, uint32_t len ) {
+  static uint32_t sink;
+  dma_channel_config c = dma_channel_get_default_config( ch );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, false );
+  channel_config_set_dreq( &c, DREQ_XIP_STREAM );
+  channel_config_set_sniff_enable( &c, true );
+
+  while ( !( xip_ctrl_hw->stat & XIP_STAT_FIFO_EMPTY_BITS ) ) {
+    (void) xip_ctrl_hw->stream_fifo;
+  }
+  xip_ctrl_hw->stream_addr = (uint32_t) addr;
+  xip_ctrl_hw->stream_ctr = len / 4;
+
+  dma_channel_configure( ch, &c, &sink, (const void *) XIP_AUX_BASE, len / 4, true );
+  dma_channel_wait_for_finish_blocking( ch );
+}
+
+// Whether slot n matches its CRC. Called before the slot is served: at boot,
+// or while the menu waits in RAM for the metadata's busy flag to clear. The
+// sniffer is BUS_COUNTERS' read count meanwhile, it misses no reads as the
+// console doesn't make any.
+bool slotCheck( uint32_t n ) {
+  if ( n >= SLOTDIR_MAX || slotCRC.slot[ n ].len == 0 ) {
+    return true;
+  }
+  if ( slotState[ n ] != SLOT_UNCHECKED ) {
+    return slotState[ n ] == SLOT_GOOD;
+  }
+
+  uint32_t len = slotCRC.slot[ n ].len;
+  uint32_t start = timer_hw->timerawl;
+  bool good = ( len % 4 ) == 0;
+
+  // Where the patcher put the slot. A block list is checked block by block.
+  const uint8_t *base;
+  const volatile uint16_t *blocks = NULL;
+  if ( slotDir.count == 0 ) {
+    base = rom + ROMSIZE * n;
+  } else if ( n >= slotDir.count ) {
+    base = rom;
+    good = false;
+  } else if ( slotDir.slot[ n ].packed != 0 ) {
+    base = rom + slotDir.slot[ n ].offset;
+  } else {
+    #ifdef PAGE_TABLE
+    uint32_t count = 0;
+    blocks = slotBlocks( n, &count );
+    if ( slotDir.slot[ n ].blocks != 0 && ( blocks == NULL || len != count * BLOCK_SIZE ) ) {
+      good = false;
+    }
+    #endif
+    uint32_t bits;
+    base = (const uint8_t *) slotLookup( n, &bits );
+  }
+  if ( blocks == NULL && ( base == NULL || (uint32_t) ( base - rom ) > sizeof( rom ) || len > sizeof( rom ) - ( base - rom ) ) ) {
+    good = false;
+  }
+
+  if ( good ) {
+    #ifdef BUS_COUNTERS
+    uint32_t sniffCtrl = dma_hw->sniff_ctrl;
+    uint32_t sniffData = dma_hw->sniff_data;
+    #endif
+
+    // CRC32R with the result reversed and inverted is zlib's CRC32.
+    int ch = dma_claim_unused_channel( true );
+    dma_sniffer_enable( ch, DMA_SNIFF_CTRL_CALC_VALUE_CRC32R, true );
+    dma_sniffer_set_output_reverse_enabled( true );
+    dma_sniffer_set_output_invert_enabled( true );
+    dma_hw->sniff_data = 0xFFFFFFFF;
+
+    if ( blocks != NULL ) {
+      for ( uint32_t i = 0; i < len / BLOCK_SIZE; ++i ) {
+        slotCheckStream( ch, rom + blocks[ i ] * BLOCK_SIZE, BLOCK_SIZE );
+      }
+    } else {
+      slotCheckStream( ch, base, len );
+    }
+    good = dma_hw->sniff_data == slotCRC.slot[ n ].crc;
+    dma_channel_unclaim( ch );
+
+    #ifdef BUS_COUNTERS
+    dma_hw->sniff_ctrl = sniffCtrl;
+    dma_hw->sniff_data = sniffData;
+    #else
+    dma_sniffer_disable();
+    #endif
+  }
+
+  slotState[ n ] = good ? SLOT_GOOD : SLOT_BAD;
+  slotCheckUs = timer_hw->timerawl - start;
+
+  #ifdef SLOT_METADATA
+  if ( !good ) {
+    metaMarkBad( n );
+  }
+  #endif
+
+  return good;
+}
+#endif
+
+// lale_latch_program with a 1 << bits window: X gives the address bits above
+// the low 10, Y the slot base above the window.
+const pio_program_t *laleProgramForBits( uint32_t bits ) {
+  for ( uint32_t i = 0; i < lale_latch_program.length; ++i ) {
+    uint16_t instr = lale_latch_program.instructions[ i ];
+
+    if ( ( instr & 0xE0E0 ) == ( pio_encode_in( pio_x, 1 ) & 0xE0E0 ) ) {
+      instr = ( instr & 0x1F00 ) | pio_encode_in( pio_x, bits - 10 );
+    } else if ( ( instr & 0xE0E0 ) == ( pio_encode_in( pio_y, 1 ) & 0xE0E0 ) ) {
+      instr = ( instr & 0x1F00 ) | pio_encode_in( pio_y, 32 - bits );
+    #ifdef SINGLE_SM_ADDR
+    } else if ( ( instr & 0xE0E0 ) == ( pio_encode_in( pio_osr, 1 ) & 0xE0E0 ) ) {
+      // addr_latch.pio keeps the base in OSR.
+      instr = ( instr & 0x1F00 ) | pio_encode_in( pio_osr, 32 - bits );
+    #endif
+    }
+    laleSlotInstructions[ i ] = instr;
+  }
+
+  laleSlotProgram = lale_latch_program;
+  laleSlotProgram.instructions = laleSlotInstructions;
+  return &laleSlotProgram;
+}
+
+#ifdef LAST_SLOT
+// Slot n has a game in it.
+bool slotUsed( uint32_t n ) {
+  if ( slotDir.count == 0 ) {
+    return n < NUM_GAMES;
+  }
+  return n < slotDir.count && n < SLOTDIR_MAX && slotDir.slot[ n ].size != 0;
+}
+
+// Pick the slot to serve from power-up. Runs before the clock is raised.
+// BOOTSEL can't be used to ask for the menu, the bootrom goes into USB boot
+// when it is held, so the quick power-ups are counted in the store instead.
+// Nothing is written here: storePoll() writes the count once the game runs
+// from SRAM, and clears it after LAST_SLOT_STABLE_US. If the menu comes up,
+// the cleared count goes to flash with the next pick.
+void lastSlotStart( void ) {
+  uint8_t last;
+  uint8_t quick = 0;
+
+  // A game served from flash couldn't have its power-ups counted, as flash
+  // can't be written while it runs.
+  if ( !kvGet( KV_LAST_SLOT, &last, sizeof( last ) ) || !slotUsed( last ) ||
+       !slotInSRAM( last ) ) {
+    lastSlotStable = true;
+    return;
+  }
+
+  kvGet( KV_QUICK_BOOTS, &quick, sizeof( quick ) );
+  if ( ++quick >= LAST_SLOT_QUICK ) {
+    quick = 0;
+    lastSlotStable = true;
+  } else {
+    bootSlot = last;
+    storeUrgent = true;
+  }
+  kvSet( KV_QUICK_BOOTS, &quick, sizeof( quick ) );
+}
+
+// Note the picked slot down. Only changes the copy in SRAM, slotPick() writes
+// it while the menu waits.
+void lastSlotSave( uint32_t n ) {
+  uint8_t last = n;
+
+  if ( slotUsed( n ) ) {
+    kvSet( KV_LAST_SLOT, &last, sizeof( last ) );
+  }
+}
+#endif
+
+#ifdef SAVE_WINDOW
+// Ring entry save_data_dma writes next.
+static inline uint32_t saveHead( void ) {
+  return ( dma_hw->ch[ saveDataDma ].write_addr - (uint32_t) saveData ) / 4;
+}
+
+// Core1: apply the writes that hit the save window to the buffer. Other writes
+// (slot picks, the menu sequence) land in the ring too and are dropped here.
+// Runs from SRAM only, so core0 can write flash meanwhile.
+void __not_in_flash_func( saveLoop )( void ) {
+  while ( 1 ) {
+    uint32_t head = saveHead();
+    uint32_t tail = saveTail;
+
+    if ( ( ( head - tail ) & ( SAVE_RING_ENTRIES - 1 ) ) == SAVE_RING_ENTRIES - 1 ) {
+      ++saveOverruns;
+    }
+
+    while ( tail != head ) {
+      uint32_t offset = saveAddr[ tail ] - (uint32_t) saveBuffer;
+      if ( offset < SAVE_SIZE ) {
+        saveBuffer[ offset ] = saveData[ tail ];
+        saveDirty[ offset / FLASH_SECTOR_SIZE ] = 1;
+      }
+      tail = ( tail + 1 ) & ( SAVE_RING_ENTRIES - 1 );
+    }
+    saveTail = tail;
+  }
+}
+
+// Write the dirty sectors to the slot's save area. A sector changed again
+// while it is written stays dirty for the next time.
+void saveCommit( void ) {
+  static uint8_t sector[ FLASH_SECTOR_SIZE ];
+  bool written = false;
+
+  if ( saveSlot < 0 ) {
+    return;
+  }
+
+  uint32_t area = (uint32_t) __saves_start - XIP_BASE + saveSlot * SAVE_SIZE;
+  for ( uint32_t s = 0; s < SAVE_SECTORS; ++s ) {
+    if ( !saveDirty[ s ] ) {
+      continue;
+    }
+    saveDirty[ s ] = 0;
+    memcpy( sector, saveBuffer + s * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE );
+
+    uint32_t irq = save_and_disable_interrupts();
+    flash_range_erase( area + s * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE );
+    flash_range_program( area + s * FLASH_SECTOR_SIZE, sector, FLASH_SECTOR_SIZE );
+    restore_interrupts( irq );
+    written = true;
+  }
+
+  // Writing flash put the SSI back on boot2's setup and flushed the cache.
+  if ( written ) {
+    #ifdef FLASH_TUNING
+    flashTune();
+    #endif
+    #ifdef XIP_CACHED
+    pinROMHeader( pinnedROM );
+    #endif
+  }
+}
+
+// Called from the serving loop, writes back once the console hasn't read for
+// SAVE_IDLE_US. Flash is gone for the bus while a sector is erased, so only
+// if the game is served from SRAM (SRAM_SERVING). A game served from flash has
+// its save written at the next pick or return to the menu (saveSwitch()), what
+// it saved after that is lost at power-off.
+void savePoll( void ) {
+  uint32_t addr = dma_hw->ch[ saveBusDma ].read_addr;
+  uint32_t now = timer_hw->timerawl;
+
+  if ( addr != saveLastAddr ) {
+    saveLastAddr = addr;
+    saveLastSeen = now;
+    return;
+  }
+  if ( now - saveLastSeen >= SAVE_IDLE_US && !servedFromFlash() ) {
+    saveCommit();
+  }
+}
+
+// Hand the buffer over to slot n (-1 for none). What the last slot wrote is
+// applied and written first; the game waits in RAM meanwhile, like for a pick.
+void saveSwitch( int n ) {
+  while ( saveTail != saveHead() ) {
+    tight_loop_contents();
+  }
+  saveCommit();
+
+  if ( n >= 0 && (uint32_t) ( n + 1 ) * SAVE_SIZE <= (uint32_t) ( __saves_end - __saves_start ) ) {
+    memcpy( saveBuffer, __saves_start + n * SAVE_SIZE, SAVE_SIZE );
+    saveSlot = n;
+  } else {
+    memset( saveBuffer, 0xFF, SAVE_SIZE );
+    saveSlot = -1;
+  }
+}
+
+// Point the window's pages of the table being built at the buffer.
+void saveMap( void ) {
+  for ( uint32_t i = 0; i < SAVE_PAGES; ++i ) {
+    pageTable[ SAVE_FIRST_PAGE + i ] = ( (uint32_t) saveBuffer >> PAGE_BITS ) + i;
+  }
+}
+
+// Catch every write with two channels: save_addr_dma copies data_dma's read
+// address (the write cycle's LALE went through the table like a read) when the
+// save SM has the data, save_data_dma then moves the data. Core1 sorts them out.
+void saveStart( int data_dma ) {
+  PIO pio = pio1;
+  uint sm = pio_claim_unused_sm( pio, true );
+  uint offset = pio_add_program( pio, &write_check_program );
+
+  int save_addr_dma = dma_claim_unused_channel( true );
+  saveDataDma = dma_claim_unused_channel( true );
+  saveBusDma = data_dma;
+
+  dma_channel_config c = dma_channel_get_default_config( save_addr_dma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, true );
+  channel_config_set_ring( &c, true, SAVE_RING_BITS + 2 );
+  channel_config_set_dreq( &c, pio_get_dreq( pio, sm, false ) );
+  channel_config_set_chain_to( &c, saveDataDma );
+
+  dma_channel_configure(
+    save_addr_dma,
+    &c,
+    saveAddr, // Write to the address ring
+    &dma_hw->ch[ data_dma ].read_addr, // Read the address of the write cycle
+    1,                                          // Halt after each write
+    false                                       // Don't start yet
+  );
+
+  c = dma_channel_get_default_config( saveDataDma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, true );
+  channel_config_set_ring( &c, true, SAVE_RING_BITS + 2 );
+  channel_config_set_chain_to( &c, save_addr_dma );     // Wait for the next write
+
+  dma_channel_configure(
+    saveDataDma,
+    &c,
+    saveData, // Write to the data ring
+    &pio->rxf[ sm ], // Read from the save SM
+    1,                                          // Halt after each write
+    false                                       // Don't start yet
+  );
+
+  saveTail = 0;
+  multicore_launch_core1( saveLoop );
+
+  write_check_program_init( pio, sm, offset, D0, WE );
+  dma_channel_start( save_addr_dma );
+
+  saveLastAddr = dma_hw->ch[ data_dma ].read_addr;
+  saveLastSeen = timer_hw->timerawl;
+}
+#endif
+
+#ifdef SRAM_SERVING
+// Copy slot n to SRAM if it fits, or unpack it if it is compressed. Returns
+// whether the SRAM copy holds it.
+bool slotToSRAM( uint32_t n, uint32_t romAddress, uint32_t slotSize ) {
+  uint32_t loadStart = time_us_32();
+  uint32_t packedSize, unpackedSize;
+  const uint8_t *packed = slotPacked( n, &packedSize, &unpackedSize );
+  bool fromSRAM;
+
+  if ( packed != NULL ) {
+    // Broken data leaves the slot unserved, slotStart() refuses it.
+    fromSRAM = unpackToSRAM( packed, packedSize ) == unpackedSize;
+  } else if ( romAddress == 0 ) {
+    fromSRAM = false;
+  } else {
+    uint32_t romUsed = romUsedSize( (const uint8_t *) romAddress, slotSize );
+    fromSRAM = romUsed <= SRAM_ROM_SIZE;
+    if ( fromSRAM ) {
+      copyToSRAM( (const uint8_t *) romAddress, romUsed );
+    }
+  }
+
+  slotLoadUs = time_us_32() - loadStart;
+  #ifdef BUS_COUNTERS
+  counters.loadUs = slotLoadUs;
+  #endif
+  return fromSRAM;
+}
+#endif
+
+// Serve slot n instead of the menu. Called while nothing reads the cart: before
+// the DMA channels start, or while the menu waits in RAM before resetting into
+// the game (see romStart() in the menu), which covers copying the slot.
+// False if the slot can't be served (a broken entry, or packed data that
+// doesn't unpack), the menu is kept then and shows the slot as bad.
+bool slotStart( PIO pio, uint sm_lale, uint offset_lale, uint32_t n ) {
+  uint32_t slotBits;
+  uint32_t romAddress = slotLookup( n, &slotBits );
+  uint32_t slotSize = 1u << slotBits;
+  bool servable = romAddress != 0;
+
+  #ifdef PAGE_TABLE
+  uint32_t blockCount;
+  const volatile uint16_t *blocks = slotBlocks( n, &blockCount );
+  servable = servable || blocks != NULL;
+  #endif
+
+  // Copied or unpacked before anything is switched, as romSRAM isn't served
+  // by the menu.
+  #ifdef SRAM_SERVING
+  bool fromSRAM = slotToSRAM( n, romAddress, slotSize );
+  servable = servable || fromSRAM;
+  #endif
+
+  if ( !servable ) {
+    #ifdef SLOT_METADATA
+    metaMarkBad( n );
+    #endif
+    return false;
+  }
+
+  #ifdef BUS_COUNTERS
+  // The game doesn't see the menu window any more.
+  ++counters.slotSwitches;
+  statusBlock = NULL;
+  #endif
+
+  #ifdef RESET_DETECT
+  servedSlot = n;
+  #endif
+
+  #ifdef SAVE_WINDOW
+  saveSwitch( n );
+  #endif
+
+  #ifdef PAGE_TABLE
+  // Build the slot's table next to the served one and switch over with one word.
+  uint32_t romPages = slotSize / PAGE_SIZE;
+  if ( blocks != NULL ) {
+    pageMapBlocks( blocks, blockCount );
+    romPages = blockCount * BLOCK_SIZE / PAGE_SIZE;
+  } else
+  #ifdef SRAM_SERVING
+  if ( fromSRAM ) {
+    pageMap( (uint32_t) romSRAM, SRAM_ROM_SIZE / PAGE_SIZE );
+  } else
+  #endif
+  {
+    pageMap( romAddress + ROM_XIP_OFFSET, romPages );
+  }
+
+  #ifdef SAVE_WINDOW
+  saveMap();
+  #endif
+
+  #ifdef XIP_CACHED
+  if ( romAddress != 0 ) {
+    pinROMHeader( (const uint8_t *) romAddress );
+  }
+  #endif
+
+  #ifdef PAGE_CACHE
+  pageCacheRun( romPages );
+  #else
+  pageTableServe();
+  #endif
+  #else
+  #ifdef MEASURE_DMA_LATENCY
+  uint32_t gapStart = systick_hw->cvr;
+  #endif
+
+  // Stop the LALE SM.
+  pio_sm_set_enabled( pio, sm_lale, false );
+
+  // Remove the old program.
+  pio_remove_program( pio, &lale_latch_menu_program, offset_lale );
+
+  #ifdef SRAM_SERVING
+  if ( fromSRAM ) {
+    // Serve the SRAM copy.
+    #ifdef MENU_RETURN
+    laleServed = &lale_latch_sram_program;
+    #endif
+    pio_add_program_at_offset( pio, &lale_latch_sram_program, offset_lale );
+    lale_latch_sram_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
+    pio_sm_put( pio, sm_lale, ( (uint32_t) romSRAM ) >> SRAM_ROM_BITS );
+    servedBase = (uint32_t) romSRAM;
+  } else
+  #endif
+  {
+    #ifdef XIP_CACHED
+    // Swap the menu's header for the game's.
+    pinROMHeader( (const uint8_t *) romAddress );
+    #endif
+
+    // Add the new program, with the slot's window, at the same offset.
+    const pio_program_t *program = laleProgramForBits( slotBits );
+    #ifdef MENU_RETURN
+    laleServed = program;
+    #endif
+    pio_add_program_at_offset( pio, program, offset_lale );
+
+    // Restart the LALE SM.
+    lale_latch_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
+
+    // Add the new ROM address.
+    pio_sm_put( pio, sm_lale, ( ( romAddress + ROM_XIP_OFFSET ) ) >> slotBits );
+    servedBase = romAddress + ROM_XIP_OFFSET;
+  }
+
+  #ifdef MEASURE_DMA_LATENCY
+  switchTimed( LALE, gapStart );
+  #endif
+  #endif
+
+  return true;
+}
+
+// A pick from the menu: check slot n, then serve it. With SLOT_METADATA the
+// menu waits in RAM until busy is clear, so this may take as long as a 2 MB
+// check. False if the slot was refused, the menu is still served then.
+bool slotPick( PIO pio, uint sm_lale, uint offset_lale, uint32_t n ) {
+  bool served = true;
+
+  #ifdef SLOT_METADATA
+  if ( metaServed != NULL ) {
+    metaServed->busy = 1;
+  }
+  #endif
+
+  #ifdef SLOT_CHECK
+  served = slotCheck( n );
+  #endif
+
+  #if defined( KV_STORE ) && defined( SLOT_METADATA )
+  // The menu only reads the metadata (SRAM) while it waits, the one time the
+  // values can be written if the game is going to be served from flash.
+  if ( served ) {
+    #ifdef LAST_SLOT
+    lastSlotSave( n );
+    #endif
+    storeFlush();
+  }
+  #endif
+
+  if ( served ) {
+    served = slotStart( pio, sm_lale, offset_lale, n );
+  }
+
+  // Once served the menu window is gone, clearing it only matters on a refusal.
+  #ifdef SLOT_METADATA
+  if ( metaServed != NULL ) {
+    metaServed->busy = 0;
+  }
+  #endif
+
+  return served;
+}
+
+#ifdef MENU_RETURN
+// Serve the menu again, the way doPIOStuff() set it up. The game waits in RAM
+// meanwhile, so only the current read has to be let through.
+void menuStart( PIO pio, uint sm_lale, uint offset_lale ) {
+  #ifdef XIP_CACHED
+  pinROMHeader( rom_menu );
+  #endif
+
+  #ifdef PAGE_TABLE
+  #ifdef PAGE_CACHE
+  multicore_reset_core1();
+  #endif
+  #ifdef SAVE_WINDOW
+  saveSwitch( -1 );
+  #endif
+  menuPageMap();
+  pageTableServe();
+  #else
+  while ( gpio_get( LALE ) ) {
+    tight_loop_contents();
+  }
+
+  #ifdef MEASURE_DMA_LATENCY
+  uint32_t gapStart = systick_hw->cvr;
+  #endif
+  pio_sm_set_enabled( pio, sm_lale, false );
+  pio_remove_program( pio, laleServed, offset_lale );
+  pio_add_program_at_offset( pio, &lale_latch_menu_program, offset_lale );
+  lale_latch_menu_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
+
+  #ifdef MENU_SRAM
+  #ifdef BUS_COUNTERS
+  statusBlock = (volatile counters_t *) ( menuSRAM + STATUS_OFFSET );
+  #endif
+  uint32_t menuBase = (uint32_t) menuSRAM;
+  #else
+  uint32_t menuBase = (uint32_t) rom_menu + ROM_XIP_OFFSET;
+  #endif
+  pio_sm_put( pio, sm_lale, menuBase >> 15 );
+  servedBase = menuBase;
+
+  #ifdef MEASURE_DMA_LATENCY
+  switchTimed( LALE, gapStart );
+  #endif
+  #endif
+}
+
+// Write check results while serving: the menu sequence while a game runs, the
+// next pick once the menu is back. Only noted down here, the switch itself
+// copies, unpacks and checks slots and may erase flash for the save area.
+void __not_in_flash_func( commandIRQ )( void ) {
+  while ( !pio_sm_is_rx_fifo_empty( pio1, cmdSmWe ) ) {
+    uint32_t writeData = pio_sm_get( pio1, cmdSmWe );
+    uint32_t addrData = pio_sm_get_blocking( pio1, cmdSmWeAddr );
+
+    if ( addrData != 0x3FF ) {
+      continue;
+    }
+
+    if ( menuServed ) {
+      cmdPending = writeData;
+      cmdMatched = 0;
+      #ifdef MEASURE_DMA_LATENCY
+      switchAskedUs = timer_hw->timerawl;
+      #endif
+    } else if ( writeData == menuSequence[ cmdMatched ] ) {
+      if ( ++cmdMatched == sizeof( menuSequence ) ) {
+        cmdPending = CMD_MENU;
+        cmdMatched = 0;
+        #ifdef MEASURE_DMA_LATENCY
+        switchAskedUs = timer_hw->timerawl;
+        #endif
+      }
+    } else {
+      cmdMatched = ( writeData == menuSequence[ 0 ] ) ? 1 : 0;
+    }
+  }
+}
+
+// Called from the serving loop. Does the switch commandIRQ() noted down, while
+// the game or the menu waits in RAM.
+void commandPoll( void ) {
+  int32_t cmd = cmdPending;
+
+  if ( cmd == CMD_NONE ) {
+    return;
+  }
+  cmdPending = CMD_NONE;
+
+  if ( cmd == CMD_MENU ) {
+    if ( !menuServed ) {
+      menuStart( pio0, cmdSmLale, cmdOffsetLale );
+      menuServed = true;
+    }
+    return;
+  }
+
+  // Stay on the menu if the slot is refused, it shows the slot as bad.
+  if ( !menuServed || !slotPick( pio0, cmdSmLale, cmdOffsetLale, cmd ) ) {
+    return;
+  }
+  menuServed = false;
+}
+#endif
+
+#ifdef RESET_DETECT
+// Whether data_dma's read address is console address RESET_START-RESET_END of
+// the served image.
+bool resetRead( uint32_t addr ) {
+  #ifdef PAGE_TABLE
+  return ( addr >> PAGE_BITS ) == pageTable[ RESET_START >> PAGE_BITS ] &&
+         ( addr & ( PAGE_SIZE - 1 ) ) - ( RESET_START & ( PAGE_SIZE - 1 ) ) < RESET_END - RESET_START;
+  #else
+  return addr - servedBase - RESET_START < RESET_END - RESET_START;
+  #endif
+}
+
+// Called from the serving loop. Mostly a timer compare, data_dma is read every
+// RESET_POLL_US.
+void __not_in_flash_func( resetPoll )( void ) {
+  uint32_t now = timer_hw->timerawl;
+  if ( now - resetLastPoll < RESET_POLL_US ) {
+    return;
+  }
+  resetLastPoll = now;
+
+  uint32_t addr = dma_hw->ch[ resetDataDma ].read_addr;
+  if ( addr != resetLastAddr ) {
+    resetLastAddr = addr;
+    resetLastSeen = now;
+    return;
+  }
+  if ( now - resetLastSeen < RESET_IDLE_US ) {
+    return;
+  }
+
+  // Quiet for long enough. Wait for the next read on OE through SIO, which
+  // stays off the bus: data_dma keeps that read's address until the next LALE.
+  bool idle = false;
+  while ( 1 ) {
+    bool oe = sio_hw->gpio_in & ( 1u << OE );
+    if ( oe && idle ) {
+      break;
+    }
+    idle = idle || !oe;
+    if ( timer_hw->timerawl - now >= RESET_WAIT_US ) {
+      return;
+    }
+  }
+  addr = dma_hw->ch[ resetDataDma ].read_addr;
+  resetLastAddr = addr;
+  resetLastSeen = timer_hw->timerawl;
+
+  if ( !resetRead( addr ) ) {
+    return;
+  }
+  ++resetCount;
+  #ifdef MEASURE_DMA_LATENCY
+  switchAskedUs = resetLastSeen;
+  #endif
+
+  // The BIOS is still checking the header, switch before it jumps in.
+  #if RESET_POLICY == RESET_TO_MENU
+  if ( !menuServed ) {
+    menuStart( pio0, cmdSmLale, cmdOffsetLale );
+    menuServed = true;
+  }
+  #else
+  if ( menuServed && servedSlot >= 0 ) {
+    slotStart( pio0, cmdSmLale, cmdOffsetLale, servedSlot );
+    menuServed = false;
+  }
+  #endif
+  cmdMatched = 0;
+}
+#endif
+#endif
+
+#ifdef FAST_BOOT
+// Lock PLL_SYS on the final frequency but run clk_sys at a fraction of it,
+// while the voltage goes up. Going to the full clock is then only a divider
+// change, which is glitch free and done by fastClockFinish() while serving.
+void fastClockStart( const clock_pair_t *clk ) {
+  uint vco, postdiv1, postdiv2;
+
+  vreg_set_voltage( clk->vreg );
+  fastBootVregUs = timer_hw->timerawl;
+
+  if ( !check_sys_clock_khz( clk->khz, &vco, &postdiv1, &postdiv2 ) ) {
+    // No exact PLL setup, let the SDK do it the slow way.
+    set_sys_clock_khz( clk->khz, true );
+    fastBootHz = clock_get_hz( clk_sys );
+    return;
+  }
 
-#else
-#include "lale.pio.h"
-#endif
+  // Off PLL_SYS while it relocks, like set_sys_clock_pll().
+  clock_configure( clk_sys, CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX,
+                   CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB, 48 * MHZ, 48 * MHZ );
+  pll_init( pll_sys, 1, vco, postdiv1, postdiv2 );
 
+  fastBootHz = vco / ( postdiv1 * postdiv2 );
+  clock_configure( clk_sys, CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX,
+                   CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS, fastBootHz, fastBootHz / FAST_BOOT_DIV );
+  clock_configure( clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLK_SYS,
+                   fastBootHz / FAST_BOOT_DIV, fastBootHz / FAST_BOOT_DIV );
+}
 
-// We don't use the Flash cache.
-#define XIP_CACHE   0x10000000
-#define XIP_NOCACHE 0x13000000
-#define XIP_NOCACHE_OFFSET (XIP_NOCACHE - XIP_CACHE)
+// Wait for the voltage, then go to divider 1. clock_configure() would park
+// clk_sys on clk_ref for the switch, so the divider is written directly.
+void __not_in_flash_func( fastClockFinish )( void ) {
+  while ( timer_hw->timerawl - fastBootVregUs < FAST_BOOT_SETTLE_US ) {
+    tight_loop_contents();
+  }
 
-// Pin Definitions.
-#define A0A10 0
-#define A1A11 1
-#define A2A12 2
-#define A3A13 3
-#define A4A14 4
-#define A5A15 5
-#define A6A16 6
-#define A7A17 7
-#define A8A18 8
-#define A9A19 9
-#define A20 10
+  clocks_hw->clk[ clk_sys ].div = 1u << CLOCKS_CLK_SYS_DIV_INT_LSB;
+  clock_set_reported_hz( clk_sys, fastBootHz );
+  clock_set_reported_hz( clk_peri, fastBootHz );
 
-#define D0 17
-#define D1 18
-#define D2 19
-#define D3 20
-#define D4 21
-#define D5 22
-#define D6 23
-#define D7 24
+  #ifdef LOW_POWER
+  // Was read at the half clock.
+  powerFullDiv = clocks_hw->clk[ clk_sys ].div;
+  #endif
+}
+#endif
 
-#define HALE 11
-#define LALE 12
-#define WE 13
-#define OE 14
-#define CS 15
+#ifdef MENU_SRAM
+// Menu from SRAM, with the status block and the metadata in the unused end of its window.
+void menuFill( void ) {
+  #ifdef SLOT_METADATA
+  _Static_assert( sizeof( rom_menu ) <= META_OFFSET, "The menu runs into the slot metadata" );
+  #else
+  _Static_assert( sizeof( rom_menu ) <= STATUS_OFFSET, "The menu runs into the status block" );
+  #endif
+  memcpy( menuSRAM, rom_menu, sizeof( rom_menu ) );
+  memset( menuSRAM + sizeof( rom_menu ), 0, sizeof( menuSRAM ) - sizeof( rom_menu ) );
+  #ifdef BUS_COUNTERS
+  ( (volatile counters_t *) ( menuSRAM + STATUS_OFFSET ) )->magic = STATUS_MAGIC;
+  #endif
+  #ifdef SLOT_METADATA
+  metaBuild( menuSRAM + META_OFFSET );
+  #endif
+}
+#endif
 
 void __not_in_flash_func( doPIOStuff() ) {
+  #ifdef MEASURE_DMA_LATENCY
+  // Both paths, before anything else is using the flash.
+  #ifndef MULTICART
+  measureLatency( &latencyFlash, rom + XIP_NOCACHE_OFFSET, sizeof( rom ) );
+  #else
+  measureLatency( &latencyFlash, rom + XIP_NOCACHE_OFFSET, ROMSIZE );
+  #endif
+  measureLatency( &latencySRAM, (const uint8_t *) SRAM_BASE, 128 * 1024 );
+  #ifdef PAGE_TABLE
+  measureLatency( &latencyTable, (const uint8_t *) pageTables, sizeof( pageTables ) );
+  #endif
+  #endif
+
+  #ifdef XIP_CACHED
+  #ifndef MULTICART
+  const uint8_t *pinned = rom;
+  #else
+  const uint8_t *pinned = rom_menu;
+  #endif
+  #ifdef MEASURE_DMA_LATENCY
+  // Cold cache first, then the header once it is pinned.
+  xip_ctrl_hw->flush = 1;
+  (void) xip_ctrl_hw->flush;
+  #ifndef MULTICART
+  measureLatency( &latencyCached, rom, sizeof( rom ) );
+  #else
+  measureLatency( &latencyCached, rom, ROMSIZE );
+  #endif
+  #endif
+  pinROMHeader( pinned );
+  #ifdef MEASURE_DMA_LATENCY
+  measureLatency( &latencyPinned, pinned + PIN_START, PIN_END - PIN_START );
+  #endif
+  #endif
+
   // Set up PIOs.
 
   // OE toggle program.
@@ -81,25 +3024,98 @@ void __not_in_flash_func( doPIOStuff() ) {
   uint sm_pushData = pio_claim_unused_sm( pio, false );
   uint offset_pushData = pio_add_program( pio, &push_databits_program );
 
+  #ifndef SINGLE_SM_ADDR
   // HALE latching.
   uint sm_hale = pio_claim_unused_sm( pio, false );
+  #ifdef PAGE_TABLE
+  uint offset_hale = pio_add_program( pio, &hale_latch_table_program );
+  #else
   uint offset_hale = pio_add_program( pio, &hale_latch_program );
+  #endif
+  #endif
 
-  // LALE latching.
+  // LALE latching (both halves with SINGLE_SM_ADDR).
   uint sm_lale = pio_claim_unused_sm( pio, false );
-  #ifndef MULTICART
+  #if defined( PAGE_TABLE )
+  uint offset_lale = pio_add_program( pio, &lale_latch_table_program );
+  #elif !defined( MULTICART )
+  #ifdef SRAM_SERVING
+  // Serve from SRAM if the ROM fits.
+  bool fromSRAM = sizeof( rom ) <= SRAM_ROM_SIZE;
+  if ( fromSRAM ) {
+    copyToSRAM( rom, sizeof( rom ) );
+  }
+  uint offset_lale = pio_add_program( pio, fromSRAM ? &lale_latch_sram_program : &lale_latch_program );
+  #else
   uint offset_lale = pio_add_program( pio, &lale_latch_program );
+  #endif
   #else
   uint offset_lale = pio_add_program( pio, &lale_latch_menu_program );
   #endif
 
 
   // Create DMAs.
+  #ifndef SINGLE_SM_ADDR
   int hale_dma = dma_claim_unused_channel( true );
+  #endif
   int lale_addr_dma = dma_claim_unused_channel( true );
   int data_dma = dma_claim_unused_channel( true );
+  #ifdef CLOCK_CALIBRATION
+  int stamp_dma = dma_claim_unused_channel( true );
+  #endif
+  #ifdef LOW_POWER
+  int wake_dma = dma_claim_unused_channel( true );
+  #endif
+  #ifdef BUS_COUNTERS
+  int count_dma = dma_claim_unused_channel( true );
+  #endif
+  #ifdef BUS_TRACE
+  int trace_dma = dma_claim_unused_channel( true );
+  #ifdef BUS_TRACE_TIME
+  int trace_time_dma = dma_claim_unused_channel( true );
+  #endif
+  #endif
+
+
+  #if defined( SINGLE_SM_ADDR )
+  dma_channel_config c;
+  #elif defined( PAGE_TABLE )
+  lookup_dma = dma_claim_unused_channel( true );
+
+  // Move the table entry address from HALE SM to the lookup channel.
+  dma_channel_config c = dma_channel_get_default_config( hale_dma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, false );
+  channel_config_set_dreq( &c, pio_get_dreq( pio, sm_hale, false) );
+
+  dma_channel_configure(
+    hale_dma,
+    &c,
+    &dma_hw->ch[ lookup_dma ].al3_read_addr_trig, // Write to READ_ADDR_TRIG of lookup channel
+    &pio->rxf[ sm_hale ],  // Read from HALE RX FIFO
+    1,                                          // Halt after each read
+    false                                       // Don't start yet
+  );
 
+  // Move the page address from the table to the LALE SM.
+  c = dma_channel_get_default_config( lookup_dma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, false );
+  channel_config_set_chain_to( &c, hale_dma );     // Trigger the HALE channel again when done
 
+  dma_channel_configure(
+    lookup_dma,
+    &c,
+    &pio->txf[ sm_lale ], // Write to the LALE SM
+    &pageTable[ 0 ], // Read from the page table (will be overwritten)
+    1,                                          // Halt after each read
+    false                                       // Don't start yet
+  );
+  #else
   // Move high address to LALE SM.
   dma_channel_config c = dma_channel_get_default_config( hale_dma );
 
@@ -116,6 +3132,7 @@ void __not_in_flash_func( doPIOStuff() ) {
     1,                                          // Halt after each read
     false                                       // Don't start yet
   );
+  #endif
 
   // Move the adress from LALE SM to the third DMA channel.
   c = dma_channel_get_default_config( lale_addr_dma );
@@ -125,7 +3142,9 @@ void __not_in_flash_func( doPIOStuff() ) {
   channel_config_set_write_increment( &c, false );
   channel_config_set_dreq( &c, pio_get_dreq( pio, sm_lale, false) );
 
+  #if !defined( PAGE_TABLE ) && !defined( SINGLE_SM_ADDR )
   channel_config_set_chain_to( &c, hale_dma );     // Trigger the HALE channel again when done
+  #endif
 
 
 
@@ -139,17 +3158,114 @@ void __not_in_flash_func( doPIOStuff() ) {
   );
 
 
+  // Channels data_dma runs through before the LALE channel.
+  int data_next = lale_addr_dma;
+  #ifdef CLOCK_CALIBRATION
+  // Copy the cycle count to calStamp, then go on with the rest of the chain.
+  pwm_config pc = pwm_get_default_config();
+  pwm_init( CAL_PWM_SLICE, &pc, true );
+
+  c = dma_channel_get_default_config( stamp_dma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, false );
+  channel_config_set_chain_to( &c, data_next );
+
+  dma_channel_configure(
+    stamp_dma,
+    &c,
+    &calStamp, // Write the time stamp
+    &pwm_hw->slice[ CAL_PWM_SLICE ].ctr, // Read from the PWM counter
+    1,                                          // Halt after each read
+    false                                       // Don't start yet
+  );
+  if ( calibrating ) {
+    data_next = stamp_dma;
+  }
+  #endif
+
+  #ifdef BUS_COUNTERS
+  // One transfer per read, the sniffer adds them up.
+  c = dma_channel_get_default_config( count_dma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, false );
+  channel_config_set_sniff_enable( &c, true );
+  channel_config_set_chain_to( &c, data_next );
+
+  dma_channel_configure(
+    count_dma,
+    &c,
+    &countSink, // Write anywhere
+    &countOne, // Read a 1
+    1,                                          // Halt after each read
+    false                                       // Don't start yet
+  );
+  dma_sniffer_enable( count_dma, DMA_SNIFF_CTRL_CALC_VALUE_SUM, true );
+  dma_hw->sniff_data = 0;
+  data_next = count_dma;
+  #endif
+
+  #ifdef BUS_TRACE
+  // Copy the address data_dma just read into the trace ring. This runs after
+  // the read, so data_dma itself isn't any slower.
+  #ifdef BUS_TRACE_TIME
+  c = dma_channel_get_default_config( trace_time_dma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, true );
+  channel_config_set_ring( &c, true, TRACE_BITS + 2 );
+  channel_config_set_chain_to( &c, data_next );
+
+  dma_channel_configure(
+    trace_time_dma,
+    &c,
+    traceTime, // Write to the time ring
+    &timer_hw->timerawl, // Read the timer
+    1,                                          // Halt after each read
+    false                                       // Don't start yet
+  );
+  data_next = trace_time_dma;
+  #endif
+
+  int trace_next = data_next;
+  c = dma_channel_get_default_config( trace_dma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, true );
+  channel_config_set_ring( &c, true, TRACE_BITS + 2 );
+  channel_config_set_chain_to( &c, data_next );
+
+  dma_channel_configure(
+    trace_dma,
+    &c,
+    traceAddr, // Write to the address ring
+    &dma_hw->ch[ data_dma ].read_addr, // Read the address of the last read
+    1,                                          // Halt after each read
+    false                                       // Don't start yet
+  );
+  data_next = trace_dma;
+  #endif
+
   // Read the actual data.
   c = dma_channel_get_default_config( data_dma );
 
   channel_config_set_transfer_data_size( &c, DMA_SIZE_8 );
   channel_config_set_read_increment( &c, false );
   channel_config_set_write_increment( &c, false );
-  channel_config_set_chain_to( &c, lale_addr_dma );     // Trigger the LALE channel again when done
+  channel_config_set_chain_to( &c, data_next );     // Trigger the LALE channel (or the extras) again when done
 
   // Set to high priority.
   channel_config_set_high_priority( &c, true );
 
+  // ..and ahead of the cores on the bus, so the polls in the serving loops
+  // don't hold up a read.
+  bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_DMA_W_BITS | BUSCTRL_BUS_PRIORITY_DMA_R_BITS;
+
   dma_channel_configure(
     data_dma,
     &c,
@@ -159,32 +3275,173 @@ void __not_in_flash_func( doPIOStuff() ) {
     false                                       // Don't start yet
   );
 
+  #ifdef LOW_POWER
+  // Put the full speed divider back once the LALE SM has an address, then hand
+  // over to the LALE channel. Only armed while the bus is idle.
+  powerFullDiv = clocks_hw->clk[ clk_sys ].div;
+
+  c = dma_channel_get_default_config( wake_dma );
+
+  channel_config_set_transfer_data_size( &c, DMA_SIZE_32 );
+  channel_config_set_read_increment( &c, false );
+  channel_config_set_write_increment( &c, false );
+  channel_config_set_dreq( &c, pio_get_dreq( pio, sm_lale, false) );
+  channel_config_set_chain_to( &c, lale_addr_dma );     // Trigger the LALE channel when done
+
+  dma_channel_configure(
+    wake_dma,
+    &c,
+    &clocks_hw->clk[ clk_sys ].div, // Write the clk_sys divider
+    &powerFullDiv, // Read the full speed value
+    1,                                          // Halt after each read
+    false                                       // Don't start yet
+  );
+  #endif
+
   // Start the SMs.
   oe_toggle_program_init( pio, sm_oe, offset_oe, D0, OE );
   push_databits_program_init( pio, sm_pushData, offset_pushData, D0 );
+  #ifdef PAGE_TABLE
+  hale_latch_table_program_init( pio, sm_hale, offset_hale, A0A10, HALE );
+  lale_latch_table_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
+
+  // Takes the table base from pageTableServe().
+  tableSm = sm_hale;
+  #else
+  #ifndef SINGLE_SM_ADDR
   hale_latch_program_init( pio, sm_hale, offset_hale, A0A10, HALE );
+  #endif
   #ifndef MULTICART
+  #ifdef SRAM_SERVING
+  if ( fromSRAM ) {
+    lale_latch_sram_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
+  } else {
+    lale_latch_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
+  }
+  #else
   lale_latch_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
+  #endif
   #else
   lale_latch_menu_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
   #endif
 
   // Push the base address of the array.
   #ifndef MULTICART
-  pio_sm_put( pio, sm_lale, ( ( (uint32_t) rom + XIP_NOCACHE_OFFSET ) ) >> 20 );
+  #ifdef SRAM_SERVING
+  if ( fromSRAM ) {
+    pio_sm_put( pio, sm_lale, ( (uint32_t) romSRAM ) >> SRAM_ROM_BITS );
+    servedBase = (uint32_t) romSRAM;
+  } else {
+    pio_sm_put( pio, sm_lale, ( ( (uint32_t) rom + ROM_XIP_OFFSET ) ) >> 21 );
+    servedBase = (uint32_t) rom + ROM_XIP_OFFSET;
+  }
+  #else
+  // rom is aligned to the 2 MB window, memmap.ld fails the link otherwise.
+  pio_sm_put( pio, sm_lale, ( ( (uint32_t) rom + ROM_XIP_OFFSET ) ) >> 21 );
+  servedBase = (uint32_t) rom + ROM_XIP_OFFSET;
+  #endif
   #else
   //pio_sm_put( pio, sm_lale, ( ( (uint32_t) rom_menu + XIP_NOCACHE_OFFSET ) ) >> 14 );
-  pio_sm_put( pio, sm_lale, ( ( (uint32_t) rom_menu + XIP_NOCACHE_OFFSET ) ) >> 15 );   //Allows a bigger multirom.min file size
+  #ifdef MENU_SRAM
+  // Filled by menuFill() further down.
+  #ifdef BUS_COUNTERS
+  statusBlock = (volatile counters_t *) ( menuSRAM + STATUS_OFFSET );
+  #endif
+  pio_sm_put( pio, sm_lale, ( (uint32_t) menuSRAM ) >> 15 );
+  servedBase = (uint32_t) menuSRAM;
+  #else
+  pio_sm_put( pio, sm_lale, ( ( (uint32_t) rom_menu + ROM_XIP_OFFSET ) ) >> 15 );   //Allows a bigger multirom.min file size
+  servedBase = (uint32_t) rom_menu + ROM_XIP_OFFSET;
+  #endif
+  #endif
+  #endif
+
+  #ifdef PAGE_TABLE
+  #ifndef MULTICART
+  pageCacheStart( (uint32_t) rom, ( sizeof( rom ) + PAGE_SIZE - 1 ) / PAGE_SIZE );
+  #else
+  #ifdef SLOT_METADATA
+  metaBuild( metaPage );
+  #endif
+  menuPageMap();
+  #ifdef BUS_COUNTERS
+  statusBlock->magic = STATUS_MAGIC;
+  #endif
+  // Only one base may wait in the HALE SM's FIFO, slotStart() pushes the game's.
+  if ( bootSlot < 0 ) {
+    pageTableServe();
+  }
+  #endif
+  #endif
+
+  #ifdef BUS_COUNTERS
+  #ifndef SINGLE_SM_ADDR
+  countSmHale = sm_hale;
+  #endif
+  countSmLale = sm_lale;
+  countSmPush = sm_pushData;
+
+  // Start from clean flags.
+  pio->irq = 3u;
+  pio->fdebug = 0xFFFFFFFF;
+  pio_set_irq0_source_mask_enabled( pio, PIO_INTR_SM0_BITS | PIO_INTR_SM1_BITS, true );
+  irq_set_exclusive_handler( PIO0_IRQ_0, glitchIRQ );
+  irq_set_enabled( PIO0_IRQ_0, true );
+  #endif
+
+  #ifdef SAVE_WINDOW
+  saveStart( data_dma );
+  #endif
+
+  #ifdef MULTICART
+  // Straight into the game, the menu is never served. Unless the slot can't
+  // be served, then it's the menu after all.
+  if ( bootSlot >= 0 && !slotStart( pio, sm_lale, offset_lale, bootSlot ) ) {
+    bootSlot = -1;
+    #ifdef PAGE_TABLE
+    pageTableServe();
+    #endif
+  }
+  #endif
+  #ifdef MENU_SRAM
+  // A game served from power-up doesn't wait for the menu copy.
+  if ( bootSlot < 0 ) {
+    menuFill();
+  }
   #endif
 
   // Start the DMA channels.
+  #ifdef BOOT_TIMING
+  bootDataDma = data_dma;
+  bootReadAddr = dma_hw->ch[ data_dma ].read_addr;
+  #endif
+  #ifndef SINGLE_SM_ADDR
   dma_start_channel_mask( 1u << hale_dma );
+  #endif
   dma_start_channel_mask( 1u << lale_addr_dma );
+  bootMark( BOOT_SERVING );
+
+  #ifdef FAST_BOOT
+  fastClockFinish();
+  #endif
+  bootMark( BOOT_FULL_CLOCK );
+
+  #ifdef MENU_SRAM
+  // For MENU_RETURN, and what the game's counters are mirrored into.
+  if ( bootSlot >= 0 ) {
+    menuFill();
+  }
+  #endif
 
   #ifdef MULTICART
-  // Wait a bit.
-  for ( uint32_t cnt = 0; cnt < DELAY; ++cnt ) {
-    tight_loop_contents();
+  if ( bootSlot < 0 ) {
+    // Wait a bit.
+    for ( uint32_t cnt = 0; cnt < DELAY; ++cnt ) {
+      #ifdef BOOT_TIMING
+      bootPoll();
+      #endif
+      tight_loop_contents();
+    }
   }
 
   // Now also start the write check PIO.
@@ -198,60 +3455,166 @@ void __not_in_flash_func( doPIOStuff() ) {
   uint offset_we_addr = pio_add_program( pioWE, &write_check_addr_program );
   write_check_addr_program_init( pioWE, sm_we_addr, offset_we_addr, A0A10, WE );
 
-  // Wait till proper write.
-  uint32_t writeData;
-  uint32_t addrData;
-  while ( 1 ) {
-    if ( !pio_sm_is_rx_fifo_empty( pioWE, sm_we ) ) {
-      // Got a write. Right lower address?
-      writeData = pio_sm_get( pioWE, sm_we );
-      addrData = pio_sm_get( pioWE, sm_we_addr );
-
-      if ( addrData == 0x3FF ) {
-        // Fitting lower address.
-        break;
-      }
+  if ( bootSlot < 0 ) {
+    // Wait till proper write.
+    uint32_t writeData;
+    uint32_t addrData;
+    while ( 1 ) {
+      #ifdef BUS_COUNTERS
+      countersPoll();
+      #endif
+      #ifdef BOOT_TIMING
+      bootPoll();
+      #endif
+      if ( !pio_sm_is_rx_fifo_empty( pioWE, sm_we ) ) {
+        // Got a write. Right lower address?
+        writeData = pio_sm_get( pioWE, sm_we );
+        addrData = pio_sm_get( pioWE, sm_we_addr );
+
+        if ( addrData == 0x3FF ) {
+          #ifdef MEASURE_DMA_LATENCY
+          switchAskedUs = timer_hw->timerawl;
+          #endif
+          // Fitting lower address. Stays on the menu if the slot is refused.
+          if ( slotPick( pio, sm_lale, offset_lale, writeData ) ) {
+            break;
+          }
+        }
 
+      }
     }
   }
 
-  uint32_t romAddress = (uint32_t) rom;
-  romAddress += (ROMSIZE * writeData);
-
-  // Stop the LALE SM.
-  pio_sm_set_enabled( pio, sm_lale, false );
-
-  // Remove the old program.
-  pio_remove_program( pio, &lale_latch_menu_program, offset_lale );
-
-  // Add the new program at the same offset.
-  pio_add_program_at_offset( pio, &lale_latch_program, offset_lale );
-
-  // Restart the LALE SM.
-  lale_latch_program_init( pio, sm_lale, offset_lale, A0A10, LALE );
-
-  // Add the new ROM address.
-  pio_sm_put( pio, sm_lale, ( ( romAddress + XIP_NOCACHE_OFFSET ) ) >> 19 );
+  #ifdef MENU_RETURN
+  // Keep the write check SMs as a command channel, handled in their IRQ.
+  cmdSmLale = sm_lale;
+  cmdOffsetLale = offset_lale;
+  cmdSmWe = sm_we;
+  cmdSmWeAddr = sm_we_addr;
+  pio_set_irq0_source_enabled( pioWE, pis_sm0_rx_fifo_not_empty + sm_we, true );
+  irq_set_exclusive_handler( PIO1_IRQ_0, commandIRQ );
+  irq_set_enabled( PIO1_IRQ_0, true );
 
+  #ifdef RESET_DETECT
+  resetDataDma = data_dma;
+  resetLastAddr = dma_hw->ch[ data_dma ].read_addr;
+  resetLastSeen = timer_hw->timerawl;
+  #endif
+  #else
   // Stop WE checking SMs.
   pio_sm_set_enabled( pioWE, sm_we, false );
   pio_sm_set_enabled( pioWE, sm_we_addr, false );
   #endif
+  #endif
+
+  #ifdef KV_STORE
+  storeStart( data_dma );
+  #endif
 
+  #ifdef CLOCK_CALIBRATION
+  if ( calibrating ) {
+    calibrationFinish();
+  }
+  #endif
 
+  #if defined( LOW_POWER )
+  powerLoop( data_dma, lale_addr_dma, wake_dma );
+  #elif defined( USB_REPORTS )
+  #ifdef BUS_TRACE
+  usbLoop( data_dma, trace_dma, trace_next );
+  #else
+  usbLoop( data_dma, -1, -1 );
+  #endif
+  #else
   // Do nothing.
   while ( 1 ) {
+    #ifdef BUS_COUNTERS
+    countersPoll();
+    #endif
+    #ifdef BOOT_TIMING
+    bootPoll();
+    #endif
+    #ifdef MENU_RETURN
+    commandPoll();
+    #endif
+    #ifdef RESET_DETECT
+    resetPoll();
+    #endif
+    #ifdef KV_STORE
+    storePoll();
+    #endif
+    #ifdef SAVE_WINDOW
+    savePoll();
+    #endif
     tight_loop_contents();
   }
+  #endif
 }
 
-int main() {
-
+// Go to the voltage and clock of pair clk.
+void clockStart( const clock_pair_t *clk ) {
+  #ifdef FAST_BOOT
+  fastClockStart( clk );
+  #else
   // Set higher freq.
   sleep_ms(2);
-  vreg_set_voltage(VREG_VOLTAGE_1_30);
+  vreg_set_voltage(clk->vreg);
   sleep_ms(2);
-  set_sys_clock_khz(240000, true);
+  set_sys_clock_khz(clk->khz, true);
+  #endif
+}
+
+int main() {
+  bootMark( BOOT_MAIN );
+  const clock_pair_t *clk = &clockPairs[ 0 ];
+  #ifdef MULTICART
+  // One game from the patcher is served like the BUILTIN_ROM build, no menu.
+  if ( slotDir.count != 0 && slotDir.boot < slotDir.count && slotDir.boot < SLOTDIR_MAX ) {
+    bootSlot = slotDir.boot;
+  }
+  #endif
+  #ifdef LAST_SLOT
+  if ( bootSlot < 0 ) {
+    lastSlotStart();
+  } else {
+    lastSlotStable = true;
+  }
+  #endif
+  #ifdef CLOCK_CALIBRATION
+  // Calibrates the class of what is served first.
+  clk = &clockPairs[ calibrationStart() ];
+  #endif
+
+  clockStart( clk );
+  bootMark( BOOT_CLOCK );
+
+  #ifdef SLOT_CHECK
+  // Checked like a pick from the menu, a bad slot brings up the menu. At the
+  // full clock, the check reads the whole slot from flash.
+  if ( bootSlot >= 0 ) {
+    #ifdef FAST_BOOT
+    // Serving waits for the check anyway.
+    fastClockFinish();
+    #endif
+    if ( !slotCheck( bootSlot ) ) {
+      bootSlot = -1;
+      #ifdef CLOCK_CALIBRATION
+      // The pair was picked for the slot's class, the first one serves any.
+      calibrationCancel();
+      clk = &clockPairs[ 0 ];
+      clockStart( clk );
+      #endif
+    }
+  }
+  #endif
+
+  #ifdef USB_REPORTS
+  stdio_init_all();
+  #endif
+
+  #ifdef FLASH_TUNING
+  flashTune();
+  #endif
 
   doPIOStuff();
 
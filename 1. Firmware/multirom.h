@@ -1,3 +1,5 @@
+// Fixed 512 KB slots, and the flash for the games. With the slot directory the
+// patcher packs up to SLOTDIR_MAX games into the same space.
 #define NUM_GAMES 20
 
 const uint8_t rom[ NUM_GAMES * 524288 ] __attribute__ ((section(".romStorage"))) = {
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+
+# Fails the build if code or constants used after boot live in flash.
+# Run by CMakeLists.txt for RAM_RESIDENT builds:
+#   python3 ram_check.py OBJDUMP ELF --root doPIOStuff [--cold panic] [--data rom]
+#
+# Starting at the roots, follows calls and branches in the disassembly, and
+# function addresses loaded from literal pools (IRQ handlers, core1 entries).
+# Every function reached has to be in SRAM, and so has every constant it loads
+# the address of, except the --data ones that are served from flash anyway.
+# --cold functions (error paths) may stay in flash and aren't followed.
+
+import argparse
+import re
+import subprocess
+import sys
+
+FLASH_START = 0x10000000
+FLASH_END = 0x20000000
+
+funcLine = re.compile(r"^([0-9a-f]+) <([^>]+)>:$")
+branchLine = re.compile(r"\s(?:bl|blx|b|b\.n|b\.w|b[a-z]{2}(?:\.[nw])?)\s+([0-9a-f]+) <([^>+]+)>")
+wordLine = re.compile(r"\.word\s+0x([0-9a-f]+)")
+veneer = re.compile(r"^__(.+)_veneer$")
+
+parser = argparse.ArgumentParser()
+parser.add_argument("objdump")
+parser.add_argument("elf")
+parser.add_argument("--root", action="append", default=[])
+parser.add_argument("--cold", action="append", default=[])
+parser.add_argument("--data", action="append", default=[])
+args = parser.parse_args()
+
+def run(*opts):
+    return subprocess.run([args.objdump, *opts, args.elf], check=True, capture_output=True, text=True).stdout
+
+# Symbol table: address, flags, section, size, name.
+funcs = {}
+objects = []
+for line in run("-t").splitlines():
+    parts = line.split()
+    if len(parts) < 5 or not re.fullmatch(r"[0-9a-f]{8}", parts[0]):
+        continue
+    addr = int(parts[0], 16)
+    size = int(parts[-2], 16)
+    name = parts[-1]
+    if " F " in line:
+        funcs[addr & ~1] = name
+    elif " O " in line and size > 0:
+        objects.append((addr, addr + size, name))
+
+# Callees and literal words of each function.
+calls = {}
+words = {}
+current = None
+for line in run("-d").splitlines():
+    m = funcLine.match(line)
+    if m:
+        current = m.group(2)
+        calls.setdefault(current, set())
+        words.setdefault(current, set())
+        continue
+    if current is None:
+        continue
+    m = branchLine.search(line)
+    if m:
+        target = m.group(2)
+        v = veneer.match(target)
+        calls[current].add(v.group(1) if v else target)
+        continue
+    m = wordLine.search(line)
+    if m:
+        words[current].add(int(m.group(1), 16))
+
+address = {name: addr for addr, name in funcs.items()}
+
+def inFlash(addr):
+    return FLASH_START <= addr < FLASH_END
+
+def objectAt(addr):
+    for start, end, name in objects:
+        if start <= addr < end:
+            return name
+    return None
+
+errors = []
+seen = set()
+todo = [r for r in args.root if r in address]
+for r in args.root:
+    if r not in address:
+        errors.append(f"no root {r}")
+
+while todo:
+    name = todo.pop()
+    if name in seen or name in args.cold:
+        continue
+    seen.add(name)
+
+    if name in address and inFlash(address[name]):
+        errors.append(f"function {name} is in flash")
+
+    for callee in calls.get(name, ()):
+        if callee != name:
+            todo.append(callee)
+
+    for w in words.get(name, ()):
+        if (w & 1) and (w & ~1) in funcs:
+            todo.append(funcs[w & ~1])
+        elif inFlash(w):
+            obj = objectAt(w)
+            if obj is not None and obj not in args.data:
+                errors.append(f"{name} uses {obj}, which is in flash")
+
+for e in sorted(set(errors)):
+    print(f"ram_check: {e}", file=sys.stderr)
+
+if errors:
+    sys.exit(1)
+
+print(f"ram_check: {len(seen)} functions after boot, all in SRAM")
@@ -0,0 +1,12 @@
+#include "kv.h"
+#include "settings.h"
+
+_Static_assert( sizeof( settings_t ) <= KV_VALUE_MAX, "Settings don't fit into a store value" );
+
+bool settingsLoad( settings_t *s ) {
+  return kvGet( KV_SETTINGS, s, sizeof( settings_t ) );
+}
+
+void settingsSave( const settings_t *s ) {
+  kvSet( KV_SETTINGS, s, sizeof( settings_t ) );
+}
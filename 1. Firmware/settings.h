@@ -0,0 +1,39 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// No clock pair yet.
+#define SETTINGS_NONE 0xFF
+
+// Serving classes calibrated on their own (see calClass() in main.c).
+#define SETTINGS_CLASSES 6
+
+typedef struct {
+  // Lowest clock pair that passed, and the one being tried.
+  uint8_t clockPair;
+  uint8_t trialPair;
+
+  // Calibration is done, use clockPair.
+  uint8_t calibrated;
+
+  // Bus slack measured for clockPair, in ns up to 255.
+  uint8_t slackNs;
+} settings_class_t;
+
+// Kept under KV_SETTINGS in the store at the end of flash.
+typedef struct {
+  // Build and ROM the calibration belongs to.
+  uint32_t calKey;
+
+  settings_class_t cls[ SETTINGS_CLASSES ];
+} settings_t;
+
+// Latest valid record, false if there is none.
+bool settingsLoad( settings_t *s );
+
+// Change the copy in SRAM, written with the next kvFlush().
+void settingsSave( const settings_t *s );
+
+#endif
@@ -7,38 +7,67 @@
 
 #define GAMELOAD ( *((volatile uint8_t _far *)0x1FFFFF) )
 #define SLOTSPERPAGE 5
-#define TOTALSLOTS   20
-#define MAXSLOTS     30
+// SLOTDIR_MAX in the firmware.
+#define MAXSLOTS     64
 
 #define CURSORX      1
 #define LABELX       8
 #define LABELY       15
 #define LABELY_STEP  9
 
+// Wait loop after selecting a game, gives the cart some tens of ms to load it.
+#define LOADDELAY    8000
+
+// Counters the cart keeps in the last 1 KB of the menu window (BUS_COUNTERS in the firmware).
+#define CARTSTATUS   ( (volatile uint8_t *)0x7C00 )
+#define STATUSLINES  7
+
+// Slot metadata the cart puts in the 3 KB before that (SLOT_METADATA in the firmware):
+// "META", slot count, busy, then 32 bytes per slot starting with the 21 byte title.
+// METABAD is set for slots that failed the cart's CRC check (SLOT_CHECK).
+// METABUSY is set while the cart checks or loads a picked slot.
+#define CARTMETA     ( (volatile uint8_t *)0x7000 )
+#define METASLOT     32
+#define METABAD      25
+#define METABUSY     5
+
 
 uint8_t ram[1024];
 uint8_t slotChose;
 volatile uint8_t flag;
 uint8_t PAGES, LASTPAGESLOTS;
 
+// Patched by the ROM patcher, all of them for firmware with a slot directory,
+// the first 20 for the fixed slots. The rest stays empty.
 char menuTitles[ MAXSLOTS ][ 21 ] = {
   "SLOT 1", "SLOT 2", "SLOT 3", "SLOT 4", "SLOT 5",
   "SLOT 6", "SLOT 7", "SLOT 8", "SLOT 9", "SLOT A",
   "SLOT B", "SLOT C", "SLOT D", "SLOT E", "SLOT F",
-  "SLOT G", "SLOT H", "SLOT I", "SLOT J", "SLOT K",
-  "SLOT L", "SLOT M", "SLOT N", "SLOT O", "SLOT P",
-  "SLOT Q", "SLOT R", "SLOT S", "SLOT T", "SLOT U" };
+  "SLOT G", "SLOT H", "SLOT I", "SLOT J", "SLOT K" };
 
 // Index of valid slots and counter
 uint8_t gValidIdx[MAXSLOTS];
 uint8_t gValidCount = 0;
 
+// Slots the cart refused to serve, shown inverted.
+uint8_t gSlotBad[MAXSLOTS];
+
 
 static void rebuildMenuIndex(void) {
-    uint8_t i;
+    uint8_t i, slots = MAXSLOTS;
     gValidCount = 0;
 
-    for ( i=0; i < TOTALSLOTS; ++i ) {
+    // Titles from the cart if it has them, the patched ones otherwise.
+    if ( CARTMETA[0] == 'M' && CARTMETA[1] == 'E' && CARTMETA[2] == 'T' && CARTMETA[3] == 'A' ) {
+        slots = ( CARTMETA[4] < MAXSLOTS ) ? CARTMETA[4] : MAXSLOTS;
+        for ( i=0; i < slots; ++i ) {
+            memcpy( menuTitles[i], (const uint8_t *)( CARTMETA + 8 + i * METASLOT ), 20 );
+            menuTitles[i][20] = '\0';
+            gSlotBad[i] = CARTMETA[ 8 + i * METASLOT + METABAD ];
+        }
+    }
+
+    for ( i=0; i < slots; ++i ) {
         //Check if the slot is used
         if ( menuTitles[i][0] != '\0' ) {
             gValidIdx[gValidCount++] = i;
@@ -73,9 +102,24 @@ static void copyToRamEx( void ( *fOrig )( void ) ) {
 
 
 static void romStart( void ) {
+  volatile uint16_t i;
+
+  // Nothing but this loop may read the cart now, it can be writing its flash.
+  IRQ_ENA1 = 0;
+  IRQ_ENA3 = 0;
+
   // Write to special memory.
   GAMELOAD = slotChose;
 
+  // Stay in RAM while the cart loads the slot (e.g. copies it to SRAM).
+  for ( i = 0; i < LOADDELAY; ++i ) {
+  }
+
+  // A cart with metadata says when it's done: the menu window is gone once
+  // the game is served, and busy is clear if the slot was refused.
+  while ( CARTMETA[0] == 'M' && CARTMETA[1] == 'E' && CARTMETA[2] == 'T' && CARTMETA[3] == 'A' && CARTMETA[METABUSY] ) {
+  }
+
   // Reset.
   _int( 0x02 );
 }
@@ -170,7 +214,7 @@ void drawMenu( uint8_t p )
             break;
         }
         realIdx = gValidIdx[visibleIndex];
-        printPx(LABELX, y, menuTitles[ realIdx ], BLACK);
+        printPx(LABELX, y, menuTitles[ realIdx ], gSlotBad[ realIdx ] ? WHITE_ON_BLACK : BLACK);
         ++i;
 
         if ( p == PAGES - 1 ) {
@@ -317,6 +361,64 @@ void drawAboutScreenAndBlocking(void)
 }
 
 
+// Little endian 32 bit value at p as 8 hex digits.
+static void hex32( char *out, const volatile uint8_t *p ) {
+    static const char digits[] = "0123456789ABCDEF";
+    uint8_t i, b;
+
+    for ( i = 0; i < 4; ++i ) {
+        b = p[ 3 - i ];
+        out[ i * 2 ]     = digits[ b >> 4 ];
+        out[ i * 2 + 1 ] = digits[ b & 0x0F ];
+    }
+    out[ 8 ] = '\0';
+}
+
+
+void drawStatusScreenAndBlocking(void)
+{
+    // Same order as counters_t in the firmware, after the "STAT" magic.
+    static const char *labels[ STATUSLINES ] = {
+        "READS  ",
+        "GLT H  ",
+        "GLT L  ",
+        "STL H  ",
+        "STL L  ",
+        "LOST   ",
+        "SLOTS  "
+    };
+
+    char line[ 16 ];
+    uint8_t keys, keysPrev, i;
+
+    memset((void*)0x1000, 0, LCDWIDTH * (LCDHEIGHT / 8));
+    print(0, 0, "CART STATUS", BLACK);
+
+    keys = keyScan();
+
+    // Redraw until B is pressed again, the cart keeps counting meanwhile.
+    for (;;) {
+        keysPrev = keys;
+        keys     = keyScan();
+
+        if ( !(keys & KEY_B) && (keysPrev & KEY_B) ) {
+            break;
+        }
+
+        if ( CARTSTATUS[0] != 'S' || CARTSTATUS[1] != 'T' || CARTSTATUS[2] != 'A' || CARTSTATUS[3] != 'T' ) {
+            print(0, 2, "NO STATUS", BLACK_ON_WHITE);
+            continue;
+        }
+
+        for ( i = 0; i < STATUSLINES; ++i ) {
+            memcpy( line, labels[ i ], 7 );
+            hex32( line + 7, CARTSTATUS + 4 + i * 4 );
+            print(0, 1 + i, line, BLACK_ON_WHITE);
+        }
+    }
+}
+
+
 int main(void)
 {
   uint8_t keys=0, keysPrev, curPage=0, n=0;
@@ -345,7 +447,8 @@ int main(void)
 
     if ( !( keys & KEY_A ) ) {
       // Run the chosen game.
-      if (gValidCount > 0) {
+      // A slot the cart found corrupt would only bring the menu back.
+      if (gValidCount > 0 && !gSlotBad[ gValidIdx[ n + (curPage * SLOTSPERPAGE) ] ]) {
         slotChose = gValidIdx[ n + (curPage * SLOTSPERPAGE) ];
         copyToRamEx(romStart);
       }
@@ -357,6 +460,12 @@ int main(void)
       printCharPx(CURSORX, LABELY + n * LABELY_STEP, '>', BLACK_ON_WHITE);
     }
 
+    if ( !(keys & KEY_B) && (keys != keysPrev) ) {
+      drawStatusScreenAndBlocking();
+      drawMenu(curPage);
+      printCharPx(CURSORX, LABELY + n * LABELY_STEP, '>', BLACK_ON_WHITE);
+    }
+
     if ( !(keys & KEY_UP) && (keys != keysPrev) ) {
       if ( n > 0 ) {
         printCharPx(CURSORX, LABELY + n * LABELY_STEP, ' ', BLACK_ON_WHITE);
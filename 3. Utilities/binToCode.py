@@ -11,6 +11,12 @@ import os
 def usage():
     print("Usage: drag a .min file onto this script or run:")
     print("python binToCode.py INPUT [OUTPUT]  (Example: python binToCode.py rom.min rom.h)")
+    print("python binToCode.py --menu INPUT [OUTPUT]  (the menu, e.g. MULTIROM.min multimenu_20slots.h)")
+
+# The menu goes into the multi-ROM firmware as rom_menu instead of rom.
+menu = "--menu" in sys.argv
+if menu:
+    sys.argv.remove("--menu")
 
 if len(sys.argv) == 2:
     srcFile = sys.argv[1]
@@ -37,7 +43,13 @@ with open(srcFile, "rb") as f:
 
 with open(dstFile, "w") as f:
     addressBits = math.ceil(math.log2(len(outStr)))
-    curLine = f"const uint8_t rom[ {len(outStr)} ] __attribute__ ((section(\".romStorage\"))) = {{\n"
+    f.write(f"// Generated from {os.path.basename(srcFile)}\n")
+    if menu:
+        # Tells the firmware the menu knows about the status block and the metadata.
+        f.write(f"#define ROM_MENU_SIZE {len(outStr)}\n")
+        curLine = f"const uint8_t rom_menu[ {len(outStr)} ] __attribute__((aligned( 16384 ))) = {{\n"
+    else:
+        curLine = f"const uint8_t rom[ {len(outStr)} ] __attribute__ ((section(\".romStorage\"))) = {{\n"
     f.write(curLine)
     tmpCnt = 0
     firstLine = True
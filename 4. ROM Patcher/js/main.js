@@ -5,7 +5,7 @@
  * Handles drag & drop, table management, user preferences, and patch execution.
  *
  * Features:
- *  - Drag & drop support for up to 20 Pokémon Mini .min game files (≤ 512 KiB each).
+ *  - Drag & drop support for up to 20 Pokémon Mini .min game files (≤ 2 MiB each).
  *  - Duplicate detection by file and by game code.
  *  - Automatic cover display (scaled).
  *  - Game table with reorder support via drag handle (≡).
@@ -36,8 +36,8 @@
 const DEFAULT_FW_PATH   = 'firmware/PM2040.uf2';
 const NAME_MIN          = 1;
 const NAME_MAX          = 14;
-const MAX_GAMES         = 20;
-const MAX_GAME_BYTES    = 512 * 1024;
+const MAX_GAMES         = 64; // SLOTDIR_MAX in the firmware
+const MAX_GAME_BYTES    = 2 * 1024 * 1024;
 const THEME_KEY         = 'PM2040_theme';
 const CAPS_KEY          = 'PM2040_caps';
 const NAME_SRC_KEY      = 'PM2040_nameSrc';
@@ -274,7 +274,7 @@ async function addFiles(files) {
 	for (const file of list) {
 		if (file.size > MAX_GAME_BYTES) {
 			console.warn('[skip-large-game]', file.name, file.size);
-			alert(`"${file.name}" exceeds 512 KiB and was skipped.`);
+			alert(`"${file.name}" exceeds 2 MiB and was skipped.`);
 			continue;
 		}
 		const bytes = await file.arrayBuffer();
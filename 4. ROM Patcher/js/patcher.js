@@ -60,64 +60,370 @@ function patchArea( uf2bytearray, uf2Offset, patchArray, len ) {
 
 }
 
-function injectROMs( uf2bytearray, ROMStorage ) {
-  var uf2array = new Uint8Array( uf2bytearray );
-
-  // First, we care about the ROMs.
-  // Start with the ROM Offset.
+// Address of the first occurence of marker in the UF2 payload, or -1. Blocks
+// that follow on in flash are searched as one, so the marker may straddle two.
+function findMarker( uf2array, marker ) {
   const uf2chunk = 512;
   const dataoffset = 32;
   const addroffset = 12;
   const datasizeoffset = 16;
 
-  const maxLabelSize = 20;
-  const labelPlaceholder = "SLOT ";
+  // End of the last block's payload, too short for a whole marker.
+  let tail = [];
+  let tailEnd = -1;
 
-  console.log( "inject roms" );
+  for ( let i = 0; i < uf2array.length; i += uf2chunk ) {
+    var datSize = lendian32( uf2array, i + datasizeoffset );
+    var baseAddr = lendian32( uf2array, i + addroffset );
 
-  const ROMSize = 524288;
+    if ( baseAddr != tailEnd ) {
+      tail = [];
+    }
+    let data = tail.concat( Array.from( uf2array.subarray( i + dataoffset, i + dataoffset + datSize ) ) );
 
-  var foundStart = 0;
-  var ROMaddr = 0;
+    for ( let d = 0; d + marker.length <= data.length; d++ ) {
+      let k = 0;
+      while ( k < marker.length && data[ d + k ] == marker.charCodeAt( k ) ) {
+        k++;
+      }
+
+      if ( k == marker.length ) {
+        return baseAddr - tail.length + d;
+      }
+    }
+
+    tail = data.slice( Math.max( 0, data.length - ( marker.length - 1 ) ) );
+    tailEnd = baseAddr + datSize;
+  }
+
+  return -1;
+}
+
+// Read size bytes at a flash address of the UF2 payload.
+function readArea( uf2array, uf2Offset, size ) {
+  const uf2chunk = 512;
+  const dataoffset = 32;
+  const addroffset = 12;
+  const datasizeoffset = 16;
+
+  var out = new Uint8Array( size );
 
   for ( let i = 0; i < uf2array.length; i += uf2chunk ) {
-    // Get data size
     var datSize = lendian32( uf2array, i + datasizeoffset );
+    var baseAddr = lendian32( uf2array, i + addroffset );
+
+    for ( let a = Math.max( uf2Offset, baseAddr ); a < Math.min( uf2Offset + size, baseAddr + datSize ); a++ ) {
+      out[ a - uf2Offset ] = uf2array[ i + dataoffset + a - baseAddr ];
+    }
+  }
+
+  return out;
+}
+
+function pushLendian32( arr, val ) {
+  arr.push( val & 0xFF, ( val >>> 8 ) & 0xFF, ( val >>> 16 ) & 0xFF, ( val >>> 24 ) & 0xFF );
+}
+
+// CRC-32 as zlib computes it, continued from crc. The firmware gets the same
+// value from the RP2040's DMA sniffer.
+const crcTable = ( () => {
+  let table = new Uint32Array( 256 );
+  for ( let n = 0; n < 256; ++n ) {
+    let c = n;
+    for ( let k = 0; k < 8; ++k ) {
+      c = ( c & 1 ) ? ( 0xEDB88320 ^ ( c >>> 1 ) ) : ( c >>> 1 );
+    }
+    table[ n ] = c;
+  }
+  return table;
+} )();
+
+function crc32( data, crc ) {
+  let c = ( crc ^ 0xFFFFFFFF ) >>> 0;
+  for ( let i = 0; i < data.length; ++i ) {
+    c = crcTable[ ( c ^ data[ i ] ) & 0xFF ] ^ ( c >>> 8 );
+  }
+  return ( c ^ 0xFFFFFFFF ) >>> 0;
+}
+
+// Compress to an LZ4 block (no frame), the format the firmware unpacks.
+// Greedy matching through a hash of the next 4 bytes.
+function lz4Compress( src ) {
+  const hashLog = 16;
+  const matchLimit = src.length - 12;   // The last match starts at least 12 bytes before the end.
+  const lastLiterals = src.length - 5;  // ...and the last 5 bytes are literals.
+
+  let table = new Int32Array( 1 << hashLog ).fill( -1 );
+  let out = [];
+  let anchor = 0;
+
+  function pushLength( len ) {
+    while ( len >= 255 ) {
+      out.push( 255 );
+      len -= 255;
+    }
+    out.push( len );
+  }
+
+  function pushSequence( litEnd, matchLen, offset ) {
+    let litLen = litEnd - anchor;
+    let token = Math.min( litLen, 15 ) << 4;
+    if ( matchLen ) {
+      token |= Math.min( matchLen - 4, 15 );
+    }
+    out.push( token );
+    if ( litLen >= 15 ) {
+      pushLength( litLen - 15 );
+    }
+    for ( let k = anchor; k < litEnd; k++ ) {
+      out.push( src[ k ] );
+    }
+
+    if ( matchLen ) {
+      out.push( offset & 0xFF, offset >>> 8 );
+      if ( matchLen - 4 >= 15 ) {
+        pushLength( matchLen - 19 );
+      }
+    }
+  }
+
+  let i = 0;
+  while ( i < matchLimit ) {
+    let word = src[ i ] | ( src[ i + 1 ] << 8 ) | ( src[ i + 2 ] << 16 ) | ( src[ i + 3 ] << 24 );
+    let h = Math.imul( word, 2654435761 ) >>> ( 32 - hashLog );
+    let ref = table[ h ];
+    table[ h ] = i;
+
+    if ( ref >= 0 && i - ref <= 65535 &&
+         src[ ref ] == src[ i ] && src[ ref + 1 ] == src[ i + 1 ] &&
+         src[ ref + 2 ] == src[ i + 2 ] && src[ ref + 3 ] == src[ i + 3 ] ) {
+      let len = 4;
+      while ( i + len < lastLiterals && src[ ref + len ] == src[ i + len ] ) {
+        len++;
+      }
+
+      pushSequence( i, len, i - ref );
+      i += len;
+      anchor = i;
+    } else {
+      i++;
+    }
+  }
+
+  pushSequence( src.length, 0, 0 );
+  return new Uint8Array( out );
+}
+
+// Smallest window the firmware can serve a ROM of len bytes from: a power of
+// two, at least 16 KB (SLOT_MIN_BITS).
+function slotWindow( len ) {
+  let size = 16384;
+  while ( size < len ) {
+    size *= 2;
+  }
+  return size;
+}
+
+// Split the ROMs into 4 KB blocks and store each different block once, so
+// variants of a game share most of their flash. Returns the slots (offset is
+// the first block map entry), the block map and the unique blocks, or null if
+// they don't fit.
+function dedupROMs( ROMStorage, capacity ) {
+  const blockSize = 4096;
+
+  let slots = [];
+  let map = [];
+  let blocks = [];
+  let known = new Map();
+
+  for ( let i = 0; i < ENTRIES; ++i ) {
+    if ( !ROMStorage[ i ] ) {
+      slots.push( { offset: 0, size: 0, blocks: 0, packed: 0 } );
+      continue;
+    }
 
-    // Go over the data.
-    for ( let datInd = dataoffset; datInd < dataoffset + datSize; datInd++ ) {
-      if ( String.fromCharCode( uf2array[ i + datInd ] ) == 'R' &&
-        String.fromCharCode( uf2array[ i + datInd + 1 ] ) == 'O' &&
-        String.fromCharCode( uf2array[ i + datInd + 2 ] ) == 'M' &&
-        String.fromCharCode( uf2array[ i + datInd + 3 ] ) == 'S' &&
-        String.fromCharCode( uf2array[ i + datInd + 4 ] ) == 'T' &&
-        String.fromCharCode( uf2array[ i + datInd + 5 ] ) == 'A' &&
-        String.fromCharCode( uf2array[ i + datInd + 6 ] ) == 'R' &&
-        String.fromCharCode( uf2array[ i + datInd + 7 ] ) == 'T' ) {
+    let romarray = new Uint8Array( ROMStorage[ i ] );
+    let count = Math.ceil( romarray.length / blockSize );
+    slots.push( { offset: map.length, size: slotWindow( romarray.length ), blocks: count, packed: 0 } );
 
-        // Get ROM base addr.
-        var chunkBase = lendian32( uf2array, i + addroffset );
-        ROMaddr = chunkBase + datInd - dataoffset;
+    for ( let b = 0; b < count; ++b ) {
+      // Zero padded, like the slots of the packed layout.
+      let block = new Uint8Array( blockSize );
+      block.set( romarray.subarray( b * blockSize, Math.min( romarray.length, ( b + 1 ) * blockSize ) ) );
 
-        console.log( "FOUND ROMSTART" );
-        console.log( ROMaddr );
-        foundStart = 1;
-        break;
+      let key = String.fromCharCode.apply( null, block );
+      if ( !known.has( key ) ) {
+        known.set( key, blocks.length );
+        blocks.push( block );
       }
+      map.push( known.get( key ) );
     }
   }
 
-  if ( foundStart == 0 ) {
+  // The map has one entry per block of the storage.
+  if ( blocks.length * blockSize > capacity || map.length > capacity / blockSize ) {
+    return null;
+  }
+
+  console.log( "dedup: " + map.length.toString() + " blocks, " + blocks.length.toString() + " stored" );
+  return { slots: slots, map: map, blocks: blocks };
+}
+
+// Pack the ROMs into the storage. Each one sits at a multiple of its window, so
+// placing the biggest windows first leaves no gaps. ROMs the firmware can
+// unpack ( up to unpackMax ) are stored LZ4 compressed after the windows if that
+// is smaller. Returns one { offset, size, blocks, packed, data } per slot
+// ( size 0 for empty ones ), or null if they don't fit into capacity.
+function packROMs( ROMStorage, capacity, unpackMax ) {
+  let order = [];
+  let compressed = [];
+  for ( let i = 0; i < ENTRIES; ++i ) {
+    if ( !ROMStorage[ i ] ) {
+      continue;
+    }
+
+    let romarray = new Uint8Array( ROMStorage[ i ] );
+    if ( romarray.length <= unpackMax ) {
+      let data = lz4Compress( romarray );
+      if ( data.length < slotWindow( romarray.length ) ) {
+        compressed.push( { slot: i, size: romarray.length, data: data } );
+        continue;
+      }
+    }
+    order.push( i );
+  }
+  order.sort( ( a, b ) => slotWindow( ROMStorage[ b ].byteLength ) - slotWindow( ROMStorage[ a ].byteLength ) );
+
+  let slots = [];
+  for ( let i = 0; i < ENTRIES; ++i ) {
+    slots.push( { offset: 0, size: 0, blocks: 0, packed: 0 } );
+  }
+
+  let next = 0;
+  for ( const i of order ) {
+    let size = slotWindow( ROMStorage[ i ].byteLength );
+    slots[ i ] = { offset: next, size: size, blocks: 0, packed: 0 };
+    next += size;
+  }
+
+  for ( const c of compressed ) {
+    slots[ c.slot ] = { offset: next, size: c.size, blocks: 0, packed: c.data.length, data: c.data };
+    next += ( c.data.length + 3 ) & ~3;
+  }
+
+  if ( next > capacity ) {
+    return null;
+  }
+
+  return slots;
+}
+
+function injectROMs( uf2bytearray, ROMStorage ) {
+  var uf2array = new Uint8Array( uf2bytearray );
+
+  // First, we care about the ROMs.
+  // Start with the ROM Offset.
+  const maxLabelSize = 20;
+  const labelPlaceholder = "SLOT ";
+
+  console.log( "inject roms" );
+
+  const ROMSize = 524288;
+
+  // Slots of firmware without a slot directory, and the titles its menu has.
+  const fixedSlots = 20;
+
+  var ROMaddr = findMarker( uf2array, "ROMSTART" );
+  if ( ROMaddr < 0 ) {
     console.log( "did not find" );
     return;
   }
+  console.log( "FOUND ROMSTART" );
+  console.log( ROMaddr );
+
+  // Pack the ROMs if the firmware has a slot directory, otherwise use the fixed
+  // slots. Firmware with a block map (PAGE_CACHE builds) gets the deduplicated
+  // blocks instead.
+  let slots = null;
+  let blockMap = null;
+  let dirAddr = findMarker( uf2array, "SLOTDIR" );
+  if ( dirAddr >= 0 ) {
+    let header = readArea( uf2array, dirAddr + 8, 8 );
+    let capacity = lendian32( header, 0 );
+    let unpackMax = lendian32( header, 4 );
+    let mapAddr = findMarker( uf2array, "BLOCKMAP" );
+
+    if ( mapAddr >= 0 ) {
+      let dedup = dedupROMs( ROMStorage, capacity );
+      if ( dedup == null ) {
+        alert( "The games don't fit into the flash of this firmware." );
+        return;
+      }
+      slots = dedup.slots;
+      blockMap = dedup.map;
+
+      let map = [];
+      for ( const b of dedup.map ) {
+        map.push( b & 0xFF, ( b >>> 8 ) & 0xFF );
+      }
+      patchArea( uf2bytearray, mapAddr + 8, new Uint8Array( map ), map.length );
+
+      for ( let b = 0; b < dedup.blocks.length; ++b ) {
+        patchArea( uf2bytearray, ROMaddr + b * 4096, dedup.blocks[ b ], 4096 );
+      }
+    } else {
+      slots = packROMs( ROMStorage, capacity, unpackMax );
+      if ( slots == null ) {
+        alert( "The games don't fit into the flash of this firmware." );
+        return;
+      }
+    }
+
+    // One game is served from power-up without the menu, like a single ROM build.
+    let used = [];
+    for ( let i = 0; i < ENTRIES; ++i ) {
+      if ( ROMStorage[ i ] ) {
+        used.push( i );
+      }
+    }
+    let boot = ( used.length == 1 ) ? used[ 0 ] : 0xFFFFFFFF;
+
+    // magic[ 8 ], capacity, unpackMax, count, boot, then { offset, size, blocks, packed } per slot.
+    let dir = [];
+    pushLendian32( dir, ENTRIES );
+    pushLendian32( dir, boot );
+    for ( let i = 0; i < ENTRIES; ++i ) {
+      pushLendian32( dir, slots[ i ].offset );
+      pushLendian32( dir, slots[ i ].size );
+      pushLendian32( dir, slots[ i ].blocks );
+      pushLendian32( dir, slots[ i ].packed );
+    }
+    patchArea( uf2bytearray, dirAddr + 16, new Uint8Array( dir ), dir.length );
+  } else {
+    console.log( "no slot directory, using fixed slots" );
+
+    for ( let i = 0; i < ENTRIES; ++i ) {
+      if ( ROMStorage[ i ] && i >= fixedSlots ) {
+        alert( "This firmware only takes " + fixedSlots.toString() + " games." );
+        return;
+      }
+      if ( ROMStorage[ i ] && ROMStorage[ i ].byteLength > ROMSize ) {
+        alert( "This firmware only takes games up to 512 KiB." );
+        return;
+      }
+    }
+  }
 
   // Now go over all ROMs.
   for ( let i = 0; i < ENTRIES; ++i ) {
-    if ( ROMStorage[ i ] ) {
-      let curROMOffset = ROMSize * i + ROMaddr;
+    // Block listed slots are already in.
+    if ( ROMStorage[ i ] && !( slots && slots[ i ].blocks ) ) {
+      let curROMOffset = ( slots ? slots[ i ].offset : ROMSize * i ) + ROMaddr;
 
       romarray = new Uint8Array( ROMStorage[ i ] )
+      if ( slots && slots[ i ].packed ) {
+        romarray = slots[ i ].data;
+      }
 
       // Start patching. Go over each chunk.
       romLen = romarray.length;
@@ -125,29 +431,70 @@ function injectROMs( uf2bytearray, ROMStorage ) {
     }
   }
 
-  // And now the labels. Search for the base label.
-  let labelBaseAddr = 0;
-  for ( let i = 0; i < uf2array.length; i += uf2chunk ) {
-    // Get data size
-    var datSize = lendian32( uf2array, i + datasizeoffset );
+  // CRC32 of each slot as it is in flash now, for firmware that checks slots
+  // before serving them (SLOT_CHECK): the ROM or its compressed data rounded up
+  // to words, or its blocks in order.
+  let crcAddr = findMarker( uf2array, "SLOTCRC" );
+  if ( crcAddr >= 0 ) {
+    let areas = [];
+    let end = 0;
+    for ( let i = 0; i < ENTRIES; ++i ) {
+      if ( !ROMStorage[ i ] ) {
+        areas.push( [] );
+      } else if ( slots && slots[ i ].blocks ) {
+        let list = [];
+        for ( let b = 0; b < slots[ i ].blocks; ++b ) {
+          list.push( { offset: blockMap[ slots[ i ].offset + b ] * 4096, len: 4096 } );
+        }
+        areas.push( list );
+      } else {
+        let len = ( slots && slots[ i ].packed ) ? slots[ i ].packed : ROMStorage[ i ].byteLength;
+        areas.push( [ { offset: slots ? slots[ i ].offset : ROMSize * i, len: ( len + 3 ) & ~3 } ] );
+      }
 
-    // Go over the data.
-    for ( let datInd = dataoffset; datInd < dataoffset + datSize; datInd++ ) {
-      if ( String.fromCharCode( uf2array[ i + datInd ] ) == 'S' &&
-        String.fromCharCode( uf2array[ i + datInd + 1 ] ) == 'L' &&
-        String.fromCharCode( uf2array[ i + datInd + 2 ] ) == 'O' &&
-        String.fromCharCode( uf2array[ i + datInd + 3 ] ) == 'T' &&
-        String.fromCharCode( uf2array[ i + datInd + 4 ] ) == ' ' &&
-        String.fromCharCode( uf2array[ i + datInd + 5 ] ) == '1' ) {
+      for ( const a of areas[ i ] ) {
+        end = Math.max( end, a.offset + a.len );
+      }
+    }
 
-        // Get ROM base addr.
-        var chunkBase = lendian32( uf2array, i + addroffset );
-        labelBaseAddr = chunkBase + datInd - dataoffset;
+    // One pass over the UF2 for all of them.
+    let stored = readArea( uf2array, ROMaddr, end );
+    let table = [];
+    for ( let i = 0; i < ENTRIES; ++i ) {
+      let len = 0;
+      let crc = 0;
+      for ( const a of areas[ i ] ) {
+        crc = crc32( stored.subarray( a.offset, a.offset + a.len ), crc );
+        len += a.len;
+      }
+      pushLendian32( table, len );
+      pushLendian32( table, crc );
+    }
+    patchArea( uf2bytearray, crcAddr + 8, new Uint8Array( table ), table.length );
+  }
+
+  // And now the labels. Search for the base label in the menu.
+  let labelBaseAddr = findMarker( uf2array, "SLOT 1" );
+  let namesAddr = findMarker( uf2array, "SLOTNAME" );
+  let menuLabels = 0;
+  if ( labelBaseAddr >= 0 ) {
+    console.log( "FOUND GAME LABEL START" );
+    console.log( labelBaseAddr );
+
+    // The menu has room for as many titles as it has "SLOT x" placeholders.
+    let table = readArea( uf2array, labelBaseAddr, ENTRIES * ( maxLabelSize + 1 ) );
+    while ( menuLabels < ENTRIES &&
+            String.fromCharCode( ...table.subarray( menuLabels * ( maxLabelSize + 1 ), menuLabels * ( maxLabelSize + 1 ) + 5 ) ) == labelPlaceholder ) {
+      ++menuLabels;
+    }
 
-        console.log( "FOUND GAME LABEL START" );
-        console.log( labelBaseAddr );
-        foundStart = 1;
-        break;
+    // Firmware with SLOT_METADATA hands the titles over itself.
+    if ( namesAddr < 0 ) {
+      for ( let i = menuLabels; i < ENTRIES; ++i ) {
+        if ( ROMStorage[ i ] ) {
+          alert( "The menu in this firmware only has titles for " + menuLabels.toString() + " games." );
+          return;
+        }
       }
     }
   }
@@ -180,9 +527,15 @@ function injectROMs( uf2bytearray, ROMStorage ) {
     labels.push( 0 );
   }
 
-  // Create byte array.
+  // Create byte array. Firmware with SLOT_METADATA hands the titles to the menu
+  // itself, older menus have theirs patched.
   labelByteArray = new Uint8Array( labels );
-  patchArea( uf2bytearray, labelBaseAddr, labelByteArray, labels.length );
+  if ( namesAddr >= 0 ) {
+    patchArea( uf2bytearray, namesAddr + 8, labelByteArray, labels.length );
+  }
+  if ( labelBaseAddr >= 0 ) {
+    patchArea( uf2bytearray, labelBaseAddr, labelByteArray, menuLabels * ( maxLabelSize + 1 ) );
+  }
 
   // Save the patched file.
   saveByteArray( "PM2040_PATCHED.uf2", uf2bytearray );